@@ -0,0 +1,38 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "rms.h"
+#include "librms.h"
+
+int rms_open(void)
+{
+	int fd;
+
+	fd = open("/dev/" DEVICE, O_RDWR | O_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+int rms_register(int fd, unsigned long period_us, unsigned long runtime_us)
+{
+	struct rms_ioc_reg reg;
+
+	reg.period_us = period_us;
+	reg.runtime_us = runtime_us;
+	return ioctl(fd, RMS_IOC_REGISTER, &reg) ? -errno : 0;
+}
+
+int rms_yield(int fd)
+{
+	return ioctl(fd, RMS_IOC_YIELD) ? -errno : 0;
+}
+
+int rms_deregister(int fd)
+{
+	return ioctl(fd, RMS_IOC_DEREGISTER) ? -errno : 0;
+}
+
+void rms_close(int fd)
+{
+	close(fd);
+}
@@ -0,0 +1,39 @@
+#ifndef __LIBRMS_H__
+#define __LIBRMS_H__
+
+/* 
+ * Client library of the RMS module. It talks to the module through
+ * ioctl() on /dev/rms, so that a yield costs one system call instead
+ * of a write to /proc/rms/status. The calling thread is the task
+ * that gets scheduled. All functions return 0 on success or a
+ * negative error code.
+ *
+ * Typical use:
+ *
+ *   int fd = rms_open();
+ *   rms_register(fd, period_us, runtime_us);
+ *   rms_yield(fd);              wait for the first period
+ *   for (;;) {
+ *       do_job();
+ *       rms_yield(fd);          wait for the next period
+ *   }
+ *   rms_deregister(fd);
+ *   rms_close(fd);
+ */
+
+/* Opens /dev/rms and returns its file descriptor */
+int rms_open(void);
+
+/* Registers the calling thread, periods and processing times in usecs */
+int rms_register(int fd, unsigned long period_us, unsigned long runtime_us);
+
+/* Ends the current job and blocks until the next period */
+int rms_yield(int fd);
+
+/* Deregisters the calling thread */
+int rms_deregister(int fd);
+
+/* Closes /dev/rms, which also deregisters the calling thread */
+void rms_close(int fd);
+
+#endif
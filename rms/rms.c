@@ -4,153 +4,391 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/list.h>
 #include <linux/sched.h>
+#include <linux/sched/task.h>
+#include <linux/capability.h>
 #include <uapi/linux/sched/types.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/rcupdate.h>
 #include <linux/pid.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/sort.h>
 #include <linux/kthread.h>
+#include <linux/tracepoint.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
 #include <linux/compiler.h>
 #include "rms.h"
 
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_entry;
+/* Serializes registration through the files of /dev/rms */
+static DEFINE_MUTEX(rms_dev_lock);
+
+static char *policy = "rms";
+module_param(policy, charp, 0444);
+MODULE_PARM_DESC(policy, "Scheduling policy: rms (rate monotonic, the "
+				 "default) or edf (earliest deadline first)");
+static enum sched_mode sched_mode;
+
+static char *admission = "ll";
+module_param(admission, charp, 0444);
+MODULE_PARM_DESC(admission, "Admission test of rms: ll (utilization <= "
+				 "0.693, the default), hyperbolic, or rta (exact response "
+				 "time analysis). edf always admits up to utilization 1");
+static enum admission_mode admission_mode;
+
+static char *placement = "ff";
+module_param(placement, charp, 0444);
+MODULE_PARM_DESC(placement, "CPU a new task is placed on: ff (the first "
+				 "CPU it fits on, the default) or wf (the least utilized "
+				 "CPU it fits on)");
+static enum placement_mode placement_mode;
 
 static LIST_HEAD(rms_task_list);
 struct rms_task_struct {
 	struct task_struct *task;
-	struct timer_list wakeup_timer;
+	struct hrtimer wakeup_timer;
 	struct list_head list;
+	struct list_head cpu_list;
+	struct rb_node ready_node;
+	struct list_head stale_node;
 	pid_t pid;
-	unsigned long period_ms;
-	unsigned long runtime_ms;
-	unsigned long deadline_jiff;
+	int cpu;
+	/* The /dev/rms file the task registered through, if any */
+	struct file *file;
+	unsigned long period_us;
+	unsigned long runtime_us;
+	/* Absolute CLOCK_MONOTONIC time the current period ends at */
+	ktime_t deadline;
 	enum task_state state;
+	/* Blocked in the yield ioctl until dispatched */
+	bool waiting;
+	/* Affinity of the task before it was pinned to cpu */
+	struct cpumask saved_mask;
 };
 static struct kmem_cache *rms_task_struct_cache;
+
+/* What the admission tests need to know of a task */
+struct rms_admit_ent {
+	unsigned long period_us;
+	unsigned long runtime_us;
+	pid_t pid;
+};
 static DEFINE_MUTEX(rms_task_list_lock);
 
-static struct task_struct *dispatch_thread;
-static struct rms_task_struct *curr_rms_task;
-static DEFINE_MUTEX(curr_task_ptr_lock);
+/* 
+ * Tasks are partitioned among the CPUs: a task is pinned to the
+ * CPU it is placed on at registration, and only competes with
+ * the other tasks of that CPU. Every CPU has its own ready queue,
+ * dispatching thread and currently running task.
+ *
+ * READY tasks are kept in an rbtree ordered by priority, i.e.,
+ * by period (or by absolute deadline with EDF) and then by pid,
+ * with the leftmost node cached, so that picking the next task
+ * is O(1) and queueing one O(log n).
+ *
+ * The decision which task runs is made right where a job is
+ * released or ends, in the wakeup timer handler (in hardirq
+ * context) or in the YIELD handler, under the raw spinlock of
+ * the CPU. It changes the states and the current task and wakes
+ * the next task up. The priority changes that go with it can
+ * sleep, though, so the tasks whose priorities are stale are
+ * queued and updated by the next one to get to process context
+ * on the CPU: the yielding task itself, the task woken up in
+ * the yield ioctl, or, failing both, the dispatching thread.
+ */
+struct rms_cpu {
+	/* The tasks placed on the CPU, under rms_task_list_lock */
+	struct list_head tasks;
+	/* Their utilization in fixed point, under rms_task_list_lock */
+	unsigned long util;
+	/* Protects the ready queue, curr, stale and the task states */
+	raw_spinlock_t lock;
+	struct rb_root_cached ready_tree;
+	struct rms_task_struct *curr;
+	/* Tasks whose scheduling policy doesn't match their state */
+	struct list_head stale;
+	/* Serializes the updates of the policies */
+	struct mutex prio_lock;
+	struct task_struct *dispatch_thread;
+	/* Set when there is scheduling work for the dispatching thread */
+	int kick;
+};
+static DEFINE_PER_CPU(struct rms_cpu, rms_cpus);
+static struct tracepoint *exit_tp;
+
+/* 
+ * The absolute deadline of the current job of the task, i.e.,
+ * the end of the period it was released in. The job was
+ * released at deadline, when the wakeup timer expired.
+ */
+static ktime_t abs_deadline(struct rms_task_struct *rms_tsk)
+{
+	return ktime_add_us(rms_tsk->deadline, rms_tsk->period_us);
+}
+
+static bool higher_prio(struct rms_task_struct *a,
+						struct rms_task_struct *b)
+{
+	if (sched_mode == POLICY_EDF && abs_deadline(a) != abs_deadline(b))
+		return ktime_before(abs_deadline(a), abs_deadline(b));
+	if (a->period_us != b->period_us)
+		return a->period_us < b->period_us;
+	return a->pid < b->pid;
+}
+
+static bool ready_less(struct rb_node *a, const struct rb_node *b)
+{
+	return higher_prio(rb_entry(a, struct rms_task_struct, ready_node),
+			rb_entry(b, struct rms_task_struct, ready_node));
+}
+
+static struct rms_cpu *task_rms_cpu(struct rms_task_struct *rms_tsk)
+{
+	return per_cpu_ptr(&rms_cpus, rms_tsk->cpu);
+}
+
+/* Marks the task READY and queues it. Needs its CPU's lock. */
+static void enqueue_ready(struct rms_task_struct *rms_tsk)
+{
+	rms_tsk->state = READY;
+	if (RB_EMPTY_NODE(&rms_tsk->ready_node))
+		rb_add_cached(&rms_tsk->ready_node,
+					  &task_rms_cpu(rms_tsk)->ready_tree, ready_less);
+}
+
+/* 
+ * Takes the task off the ready queue if queued.
+ * Needs its CPU's lock.
+ */
+static void dequeue_ready(struct rms_task_struct *rms_tsk)
+{
+	if (RB_EMPTY_NODE(&rms_tsk->ready_node))
+		return;
+	rb_erase_cached(&rms_tsk->ready_node,
+					&task_rms_cpu(rms_tsk)->ready_tree);
+	RB_CLEAR_NODE(&rms_tsk->ready_node);
+}
 
 /* 
  * Retrieves the READY task with the highest priority 
  * (i.e., the READY task that has the shortest period)
- * in task list.
+ * on the CPU without walking the task list.
+ * Needs the CPU's lock.
  */
-static struct rms_task_struct *highest_prio_task(void)
+static struct rms_task_struct *highest_prio_task(struct rms_cpu *rc)
 {	
-	struct rms_task_struct *hgst_prio;
+	return rb_entry_safe(rb_first_cached(&rc->ready_tree),
+						 struct rms_task_struct, ready_node);
+}
+
+/* Queues the task for a policy update. Needs its CPU's lock. */
+static void mark_stale(struct rms_task_struct *rms_tsk)
+{
+	if (list_empty(&rms_tsk->stale_node))
+		list_add_tail(&rms_tsk->stale_node, &task_rms_cpu(rms_tsk)->stale);
+}
+
+/* 
+ * The scheduling policy that goes with the state of the task:
+ * SCHED_FIFO at RMS_PRIO while RUNNING, SCHED_FIFO at
+ * DISPATCH_PRIO while blocked in the yield ioctl, so that it
+ * preempts the running task as soon as it is woken up, and
+ * SCHED_NORMAL otherwise. Needs its CPU's lock.
+ */
+static void task_sched_attr(struct rms_task_struct *rms_tsk,
+							struct sched_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	if (rms_tsk->state == RUNNING) {
+		attr->sched_policy = SCHED_FIFO;
+		/*
+		 * sched_priority sets rt_priority,
+		 * i.e., the rt_priority will be RMS_PRIO.
+		 */
+		attr->sched_priority = RMS_PRIO;
+	} else if (rms_tsk->waiting) {
+		attr->sched_policy = SCHED_FIFO;
+		attr->sched_priority = DISPATCH_PRIO;
+	} else {
+		/* None-RT tasks don't use sched_priority */
+		attr->sched_policy = SCHED_NORMAL;
+	}
+}
+
+/* 
+ * Brings the policies of the stale tasks of the CPU in line
+ * with their states. Needs the CPU's prio_lock, which keeps
+ * the tasks from being freed and the updates in order.
+ */
+static void __sync_prios(struct rms_cpu *rc)
+{
 	struct rms_task_struct *rms_tsk;
-	unsigned long shst_period;
-	
-	hgst_prio = NULL;
-	shst_period = 0;
-	mutex_lock(&rms_task_list_lock);
-	list_for_each_entry(rms_tsk, &rms_task_list, list)
-		if (rms_tsk->state == READY &&
-			(hgst_prio == NULL || 
-				rms_tsk->period_ms < shst_period)) {
-			hgst_prio = rms_tsk;
-			shst_period = rms_tsk->period_ms;
+	struct sched_attr attr;
+	unsigned long flags;
+
+	for (;;) {
+		raw_spin_lock_irqsave(&rc->lock, flags);
+		rms_tsk = list_first_entry_or_null(&rc->stale,
+					struct rms_task_struct, stale_node);
+		if (rms_tsk == NULL) {
+			raw_spin_unlock_irqrestore(&rc->lock, flags);
+			return;
 		}
-	mutex_unlock(&rms_task_list_lock);
-	return hgst_prio;
+		list_del_init(&rms_tsk->stale_node);
+		task_sched_attr(rms_tsk, &attr);
+		raw_spin_unlock_irqrestore(&rc->lock, flags);
+		sched_setattr_nocheck(rms_tsk->task, &attr);
+	}
+}
+
+static void sync_prios(struct rms_cpu *rc)
+{
+	mutex_lock(&rc->prio_lock);
+	__sync_prios(rc);
+	mutex_unlock(&rc->prio_lock);
 }
 
 /* 
- * The function that the dispatching thread will run. 
- * The main task of this function is to trigger context
- * switches and put the dispatching thread sleep the
- * rest of the time.
+ * Whether the thread of the task has exited while registered,
+ * e.g. while its /dev/rms file is still open in another thread
+ * or a child. rms_tsk holds a reference to it.
+ */
+static bool task_exited(struct rms_task_struct *rms_tsk)
+{
+	return READ_ONCE(rms_tsk->task->flags) & PF_EXITING;
+}
+
+/* 
+ * Triggers context switch. The next task only preempts the
+ * current one if it has a higher priority; if so, the current
+ * one goes back to the ready queue. The next task is woken up
+ * right away. Returns whether the policies still have to be
+ * updated by the caller, i.e., the next task isn't blocked in
+ * the yield ioctl to update them itself. Needs the CPU's lock.
+ */
+static bool dispatch(struct rms_cpu *rc)
+{
+	struct rms_task_struct *nxt_tsk;
+
+	/* 
+	 * Exited tasks are never run again. Their timers are not
+	 * armed again either, as only the tasks themselves do that.
+	 */
+	if (rc->curr && task_exited(rc->curr)) {
+		rc->curr->state = SLEEPING;
+		rc->curr = NULL;
+	}
+	while ((nxt_tsk = highest_prio_task(rc)) && task_exited(nxt_tsk)) {
+		dequeue_ready(nxt_tsk);
+		nxt_tsk->state = SLEEPING;
+		nxt_tsk->waiting = false;
+	}
+	if (nxt_tsk == NULL ||
+		(rc->curr && !higher_prio(nxt_tsk, rc->curr)))
+		return false;
+	dequeue_ready(nxt_tsk);
+	if (rc->curr) {
+		/* Preempt currently running task */
+		enqueue_ready(rc->curr);
+		mark_stale(rc->curr);
+	}
+	/* Schedule the next READY job of highest prority */
+	nxt_tsk->state = RUNNING;
+	rc->curr = nxt_tsk;
+	mark_stale(nxt_tsk);
+	wake_up_process(nxt_tsk->task);
+	if (nxt_tsk->waiting) {
+		nxt_tsk->waiting = false;
+		return false;
+	}
+	return true;
+}
+
+/* Wakes the dispatching thread of the CPU up to do its work */
+static void kick_dispatcher(struct rms_cpu *rc)
+{
+	WRITE_ONCE(rc->kick, 1);
+	wake_up_process(rc->dispatch_thread);
+}
+
+/* 
+ * The function that the dispatching thread of a CPU will run. 
+ * It is the fallback for the releases that no task in process
+ * context can follow up on: it updates the policies of the
+ * stale tasks, and sleeps the rest of the time. It runs bound
+ * to its CPU at a higher RT priority than the tasks, so that
+ * it can preempt them.
  */
 static int dispatch_thread_fn(void *data)
 {	
-	struct rms_task_struct *nxt_tsk;
+	struct rms_cpu *rc = data;
 	struct sched_attr attr;
 
+	memset(&attr, 0, sizeof(attr));
+	attr.sched_policy = SCHED_FIFO;
+	attr.sched_priority = DISPATCH_PRIO;
+	sched_setattr_nocheck(current, &attr);
+
 	while (1) {
 		/* 
 		 * Put the dispatching thread to sleep, as we want it
 		 * to be sleeping when there is no scheduling work to do.
+		 * The kick is checked after the state is set, so that
+		 * a wakeup can't be lost while it is dispatching.
 		 */
 		set_current_state(TASK_INTERRUPTIBLE);
-		schedule();
+		if (!READ_ONCE(rc->kick) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
 
 		/* After waking up, first check if it is waked up to exit */
 		if (kthread_should_stop())
 			return 0;
-
-		/* Trigger context switch */
-		nxt_tsk = highest_prio_task();
-		if (nxt_tsk) {
-			/* Schedule the next READY job of highest prority */
-			nxt_tsk->state = RUNNING;
-			wake_up_process(nxt_tsk->task);
-			attr.sched_policy = SCHED_FIFO;	
-			/*
-			 * sched_priority sets rt_priority,
-			 * i.e., the rt_priority will be 99.
-			 */
-			attr.sched_priority = 99;
-			sched_setattr_nocheck(nxt_tsk->task, &attr);
-		}
-		mutex_lock(&curr_task_ptr_lock);
-		if (curr_rms_task) {
-			/* Preempt currently running task */
-			curr_rms_task->state = READY;
-			attr.sched_policy = SCHED_FIFO;
-			/* None-RT tasks don't use sched_priority */
-			attr.sched_priority = 0; 
-			sched_setattr_nocheck(curr_rms_task->task, &attr);
-		}
-		curr_rms_task = nxt_tsk ? nxt_tsk : NULL;
-		mutex_unlock(&curr_task_ptr_lock);
+		WRITE_ONCE(rc->kick, 0);
+		sync_prios(rc);
 	}
 }
 
-static ssize_t usr_read(struct file *file,
-						char __user *buffer,
-						size_t count, loff_t *off)
+/* 
+ * Lists the registered tasks through the seq_file interface,
+ * which grows its buffer as needed, one line per task.
+ */
+static int usr_show(struct seq_file *m, void *v)
 {
-	int copied;
-	char *kbuf;
 	struct rms_task_struct *rms_tsk;
 
-	copied = 0;
-	kbuf = (char *)kmalloc(count, GFP_KERNEL);
-	if (kbuf == NULL) {
-		printk(KERN_ALERT "error: kmalloc: no memory available\n");
-		return copied;
-	}
 	mutex_lock(&rms_task_list_lock);
 	list_for_each_entry(rms_tsk, &rms_task_list, list)
-		copied += sprintf(kbuf + copied, "%d: %lu, %lu\n", 
-			rms_tsk->pid, rms_tsk->period_ms, rms_tsk->runtime_ms);
+		seq_printf(m, "%d: %luus, %luus, %d\n", 
+			rms_tsk->pid, rms_tsk->period_us, rms_tsk->runtime_us,
+			rms_tsk->cpu);
 	mutex_unlock(&rms_task_list_lock);
-	kbuf[copied] = '\0';
-	if (copy_to_user(buffer, kbuf, copied)) {
-		printk(KERN_ALERT "error: copy_to_user failed\n");
-	}
-	kfree(kbuf);
 
 	#ifdef DEBUG
 	printk(KERN_INFO "USER READ\n");
 	#endif
-    
-	if (*off > 0) /* EOF condition */
-		return 0; /* End of file */
-	*off += copied;
-	return copied;
+
+	return 0;
+}
+
+static int usr_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, usr_show, NULL);
 }
 
 /* 
- * Admits task (i.e., returns 1) only if the following
- * equation is satisfied. 
+ * Liu and Layland's test. Admits the task set only if the
+ * following equation is satisfied. 
  * 
  * \sum_{i\in T} C_i/P_i <= 0.693
  *
@@ -160,8 +398,7 @@ static ssize_t usr_read(struct file *file,
  *
  * Fixed point arithmetic is used to perform the test. 
  */
-static int admit_task(unsigned long period_ms,
-					  unsigned long runtime_ms)
+static int ll_test(const struct rms_admit_ent *ents, int nr)
 {
 	/* 
 	 * From the results in the Sha et al.'s Generalized
@@ -173,15 +410,13 @@ static int admit_task(unsigned long period_ms,
 	 * be the bound. fr stands for the fractional part. 
 	 */
 	static const unsigned long bnd_fr = 693;
-	struct rms_task_struct *rms_tsk;
 	unsigned long sum_ra;
+	int i;
 
-	sum_ra = (runtime_ms << SHIFT_AMOUNT) / period_ms;
-	mutex_lock(&rms_task_list_lock);
-	list_for_each_entry(rms_tsk, &rms_task_list, list)
-		sum_ra += (rms_tsk->runtime_ms << SHIFT_AMOUNT) /
-				  rms_tsk->period_ms;
-	mutex_unlock(&rms_task_list_lock);
+	sum_ra = 0;
+	for (i = 0; i < nr; i++)
+		sum_ra += (ents[i].runtime_us << SHIFT_AMOUNT) /
+				  ents[i].period_us;
 	/* Compare the intergral parts */
 	if (unlikely((sum_ra >> SHIFT_AMOUNT) > 0)) 
 		return 0;
@@ -191,12 +426,211 @@ static int admit_task(unsigned long period_ms,
 	return 1;
 }
 
-static struct task_struct *find_task_by_pid(int nr)
+/* 
+ * Bini et al.'s hyperbolic bound. Admits the task set if
+ *
+ * \prod_{i\in T} (C_i/P_i + 1) <= 2
+ *
+ * which accepts every set the Liu and Layland test does and
+ * more. The fixed point terms are rounded up, so rounding can
+ * only make the test stricter.
+ */
+static int hyperbolic_test(const struct rms_admit_ent *ents, int nr)
+{
+	unsigned long prod;
+	int i;
+
+	prod = 1UL << SHIFT_AMOUNT;
+	for (i = 0; i < nr; i++) {
+		prod *= DIV_ROUND_UP(ents[i].runtime_us << SHIFT_AMOUNT,
+							 ents[i].period_us) + (1UL << SHIFT_AMOUNT);
+		prod = DIV_ROUND_UP(prod, 1UL << SHIFT_AMOUNT);
+		if (prod > 2UL << SHIFT_AMOUNT)
+			return 0;
+	}
+	return 1;
+}
+
+/* 
+ * The EDF test. Admits the task set if and only if
+ *
+ * \sum_{i\in T} C_i/P_i <= 1
+ *
+ * which is exact for EDF, as the deadlines are the ends of the
+ * periods. The fixed point terms are rounded up.
+ */
+static int edf_test(const struct rms_admit_ent *ents, int nr)
+{
+	unsigned long sum_ra;
+	int i;
+
+	sum_ra = 0;
+	for (i = 0; i < nr; i++)
+		sum_ra += DIV_ROUND_UP(ents[i].runtime_us << SHIFT_AMOUNT,
+							   ents[i].period_us);
+	return sum_ra <= 1UL << SHIFT_AMOUNT;
+}
+
+static int cmp_admit_ent(const void *a, const void *b)
+{
+	const struct rms_admit_ent *x = a, *y = b;
+
+	if (x->period_us != y->period_us)
+		return x->period_us < y->period_us ? -1 : 1;
+	return x->pid < y->pid ? -1 : x->pid > y->pid;
+}
+
+/* 
+ * Exact response time analysis. With the tasks sorted by
+ * priority, the worst-case response time of the i-th task is
+ * the fixed point of
+ *
+ * R_i = C_i + \sum_{j<i} ceil(R_i/P_j) C_j
+ *
+ * starting from R_i = \sum_{j<=i} C_j, and the set is
+ * schedulable iff R_i <= P_i for every task. This admits
+ * everything RMS can schedule, e.g., harmonic sets up to 100%.
+ * All quantities are whole usecs, so no fixed point is needed.
+ */
+static int rta_test(struct rms_admit_ent *ents, int nr)
+{
+	unsigned long resp, prev, sum_c;
+	int i, j;
+
+	sort(ents, nr, sizeof(*ents), cmp_admit_ent, NULL);
+	sum_c = 0;
+	for (i = 0; i < nr; i++) {
+		sum_c += ents[i].runtime_us;
+		resp = sum_c;
+		do {
+			if (resp > ents[i].period_us)
+				return 0;
+			prev = resp;
+			resp = ents[i].runtime_us;
+			for (j = 0; j < i; j++)
+				resp += DIV_ROUND_UP(prev, ents[j].period_us) *
+						ents[j].runtime_us;
+		} while (resp != prev);
+	}
+	return 1;
+}
+
+/* 
+ * Admits the new task (i.e., returns 1) to the CPU only if it
+ * passes the test chosen with the admission parameter (or the
+ * EDF test) along with all of the tasks already placed on the
+ * CPU. In the rta mode the hyperbolic bound is tried first, as
+ * it is linear and accepts most sets; the response time
+ * analysis only runs for the sets it rejects.
+ * Needs rms_task_list_lock.
+ */
+static int admit_task(struct rms_task_struct *new_tsk, struct rms_cpu *rc)
+{
+	struct rms_task_struct *rms_tsk;
+	struct rms_admit_ent *ents;
+	int nr, ret;
+
+	nr = 1;
+	list_for_each_entry(rms_tsk, &rc->tasks, cpu_list)
+		nr++;
+	ents = kmalloc_array(nr, sizeof(*ents), GFP_KERNEL);
+	if (ents == NULL) {
+		printk(KERN_ALERT "error: kmalloc: no memory available\n");
+		return 0;
+	}
+	ents[0].period_us = new_tsk->period_us;
+	ents[0].runtime_us = new_tsk->runtime_us;
+	ents[0].pid = new_tsk->pid;
+	nr = 1;
+	list_for_each_entry(rms_tsk, &rc->tasks, cpu_list) {
+		ents[nr].period_us = rms_tsk->period_us;
+		ents[nr].runtime_us = rms_tsk->runtime_us;
+		ents[nr].pid = rms_tsk->pid;
+		nr++;
+	}
+	if (sched_mode == POLICY_EDF) {
+		ret = edf_test(ents, nr);
+		kfree(ents);
+		return ret;
+	}
+	switch (admission_mode) {
+	case ADMIT_HYPERBOLIC:
+		ret = hyperbolic_test(ents, nr);
+		break;
+	case ADMIT_RTA:
+		ret = hyperbolic_test(ents, nr) || rta_test(ents, nr);
+		break;
+	default:
+		ret = ll_test(ents, nr);
+	}
+	kfree(ents);
+	return ret;
+}
+
+struct rms_cpu_util {
+	unsigned long util;
+	int cpu;
+};
+
+static int cmp_cpu_util(const void *a, const void *b)
+{
+	const struct rms_cpu_util *x = a, *y = b;
+
+	if (x->util != y->util)
+		return x->util < y->util ? -1 : 1;
+	return x->cpu - y->cpu;
+}
+
+/* 
+ * Places the new task on a CPU, i.e., returns the CPU it is
+ * admitted to, or -1 if it doesn't fit on any. With first-fit
+ * the CPUs are tried in order, and with worst-fit in order of
+ * increasing utilization, which spreads the load out.
+ * Needs rms_task_list_lock.
+ */
+static int place_task(struct rms_task_struct *new_tsk)
+{
+	struct rms_cpu_util *cpus;
+	struct rms_cpu *rc;
+	int cpu, nr, i;
+
+	if (new_tsk->period_us == 0 ||
+		new_tsk->period_us > (ULONG_MAX >> SHIFT_AMOUNT) ||
+		new_tsk->runtime_us > new_tsk->period_us)
+		return -1;
+	cpus = kmalloc_array(nr_cpu_ids, sizeof(*cpus), GFP_KERNEL);
+	if (cpus == NULL) {
+		printk(KERN_ALERT "error: kmalloc: no memory available\n");
+		return -1;
+	}
+	nr = 0;
+	for_each_possible_cpu(cpu) {
+		rc = per_cpu_ptr(&rms_cpus, cpu);
+		if (rc->dispatch_thread == NULL)
+			continue;
+		cpus[nr].util = rc->util;
+		cpus[nr].cpu = cpu;
+		nr++;
+	}
+	if (placement_mode == PLACE_WORST_FIT)
+		sort(cpus, nr, sizeof(*cpus), cmp_cpu_util, NULL);
+	cpu = -1;
+	for (i = 0; i < nr; i++)
+		if (admit_task(new_tsk, per_cpu_ptr(&rms_cpus, cpus[i].cpu))) {
+			cpu = cpus[i].cpu;
+			break;
+		}
+	kfree(cpus);
+	return cpu;
+}
+
+/* Looks a task up by pid and takes a reference to it */
+static struct task_struct *get_task_by_pid(int nr)
 {
 	struct task_struct *task;
 
 	rcu_read_lock();
-	task = pid_task(find_vpid(nr), PIDTYPE_PID);
+	task = get_pid_task(find_vpid(nr), PIDTYPE_PID);
 	rcu_read_unlock();
 	return task;
 }
@@ -204,81 +638,301 @@ static struct task_struct *find_task_by_pid(int nr)
 /* 
  * Wakeup timer interrupt handler.
  * Changes the state of the task containing the timer
- * to READY and wake the dispatching thread up to
- * trigger context switch.
+ * to READY and triggers context switch. Only if the next
+ * task can't update the policies itself, the dispatching
+ * thread is woken up to do it.
  */
-static void _wakeup_timer_fn(struct timer_list *tl) 
+static enum hrtimer_restart _wakeup_timer_fn(struct hrtimer *timer) 
 {
 	struct rms_task_struct *rms_tsk;
+	struct rms_cpu *rc;
+	unsigned long flags;
+	bool kick;
 
-	rms_tsk = from_timer(rms_tsk, tl, wakeup_timer);
-	rms_tsk->state = READY;
-	wake_up_process(dispatch_thread);
+	rms_tsk = container_of(timer, struct rms_task_struct, wakeup_timer);
+	rc = task_rms_cpu(rms_tsk);
+	raw_spin_lock_irqsave(&rc->lock, flags);
+	enqueue_ready(rms_tsk);
+	kick = dispatch(rc);
+	raw_spin_unlock_irqrestore(&rc->lock, flags);
+	if (kick)
+		kick_dispatcher(rc);
+	return HRTIMER_NORESTART;
 }
 
-static void register_task(char *msg)
+/* 
+ * Probe of the sched_process_exit tracepoint. A registered task
+ * runs pinned to its CPU, so if the exiting task is the one 
+ * running there, it is found as the current task of this CPU,
+ * and the next task is dispatched in its place right away.
+ */
+static void probe_task_exit(void *data, struct task_struct *task)
 {
-	struct rms_task_struct *rms_tsk;
+	struct rms_cpu *rc = this_cpu_ptr(&rms_cpus);
+	unsigned long flags;
+	bool kick = false;
+
+	raw_spin_lock_irqsave(&rc->lock, flags);
+	if (rc->curr && rc->curr->task == task)
+		kick = dispatch(rc);
+	raw_spin_unlock_irqrestore(&rc->lock, flags);
+	if (kick)
+		kick_dispatcher(rc);
+}
+
+static void find_tps(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sched_process_exit"))
+		exit_tp = tp;
+}
+
+/* 
+ * Parses a period or processing time, in msecs by default or
+ * in usecs if it ends with "us", into usecs.
+ */
+static unsigned long parse_us(const char *tok)
+{
+	unsigned long val;
+	char unit[3];
+
+	if (tok == NULL)
+		return 0;
+	switch (sscanf(tok, "%lu%2s", &val, unit)) {
+	case 1:
+		return val * USEC_PER_MSEC;
+	case 2:
+		if (!strcmp(unit, "us"))
+			return val;
+		if (!strcmp(unit, "ms"))
+			return val * USEC_PER_MSEC;
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/* 
+ * Registers the task with its period and processing time, once
+ * it passes the admission control on some CPU, and pins it to
+ * that CPU. file is the /dev/rms file it registers through, or
+ * NULL for the proc filesystem entry. The rms_task_struct holds
+ * a reference to task until it is freed. Returns the new
+ * rms_task_struct or an ERR_PTR.
+ */
+static struct rms_task_struct *register_task(struct task_struct *task,
+											 pid_t pid,
+											 unsigned long period_us,
+											 unsigned long runtime_us,
+											 struct file *file)
+{
+	struct rms_task_struct *rms_tsk, *temp;
+	struct rms_cpu *rc;
+	int cpu;
 
 	rms_tsk = (struct rms_task_struct*)
 			kmem_cache_alloc(rms_task_struct_cache, GFP_KERNEL);
-	sscanf(strsep(&msg, ","), "%d", &rms_tsk->pid);
-	sscanf(strsep(&msg, ","), "%lu", &rms_tsk->period_ms);
-	sscanf(strsep(&msg, ","), "%lu", &rms_tsk->runtime_ms);
+	if (rms_tsk == NULL) {
+		printk(KERN_ALERT "error: kmem_cache_alloc: no memory available\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	rms_tsk->task = task;
+	rms_tsk->pid = pid;
+	rms_tsk->period_us = period_us;
+	rms_tsk->runtime_us = runtime_us;
+	rms_tsk->file = file;
 
-	if (!admit_task(rms_tsk->period_ms, rms_tsk->runtime_ms))
-		return;
+	mutex_lock(&rms_task_list_lock);
+	list_for_each_entry(temp, &rms_task_list, list)
+		if (temp->pid == pid) {
+			mutex_unlock(&rms_task_list_lock);
+			kmem_cache_free(rms_task_struct_cache, rms_tsk);
+			return ERR_PTR(-EEXIST);
+		}
+	cpu = place_task(rms_tsk);
+	cpumask_copy(&rms_tsk->saved_mask, task->cpus_ptr);
+	/* Pin the task to the CPU it is admitted to */
+	if (cpu < 0 || set_cpus_allowed_ptr(rms_tsk->task, cpumask_of(cpu))) {
+		mutex_unlock(&rms_task_list_lock);
+		kmem_cache_free(rms_task_struct_cache, rms_tsk);
+		return ERR_PTR(-EBUSY);
+	}
 
+	rms_tsk->cpu = cpu;
 	rms_tsk->state = SLEEPING;
-	rms_tsk->deadline_jiff = 0;
+	rms_tsk->waiting = false;
+	rms_tsk->deadline = 0;
 
-	rms_tsk->task = find_task_by_pid(rms_tsk->pid);
-	timer_setup(&rms_tsk->wakeup_timer, _wakeup_timer_fn, 0);
+	hrtimer_init(&rms_tsk->wakeup_timer, CLOCK_MONOTONIC,
+				 HRTIMER_MODE_ABS_PINNED_HARD);
+	rms_tsk->wakeup_timer.function = _wakeup_timer_fn;
+	get_task_struct(task);
+	RB_CLEAR_NODE(&rms_tsk->ready_node);
+	INIT_LIST_HEAD(&rms_tsk->stale_node);
 	INIT_LIST_HEAD(&rms_tsk->list);
-	mutex_lock(&rms_task_list_lock);
 	list_add(&rms_tsk->list, &rms_task_list);
+	rc = task_rms_cpu(rms_tsk);
+	list_add(&rms_tsk->cpu_list, &rc->tasks);
+	rc->util += (rms_tsk->runtime_us << SHIFT_AMOUNT) / rms_tsk->period_us;
 	mutex_unlock(&rms_task_list_lock);
+	return rms_tsk;
 }
 
-/* Deschedule the task that sent the YIELD message */
-static void deschedule_task(char *msg) 
+/* 
+ * Finds the task registered through the proc filesystem entry
+ * by pid, or returns NULL. Tasks registered through /dev/rms
+ * are only managed through their file.
+ */
+static struct rms_task_struct *find_rms_task(int pid)
 {
 	struct rms_task_struct *rms_tsk;
-	int pid;
 
-	sscanf(msg, "%d", &pid);
-	rms_tsk = NULL;
 	mutex_lock(&rms_task_list_lock);
 	list_for_each_entry(rms_tsk, &rms_task_list, list)
-		if (rms_tsk->pid == pid)
-			break;
+		if (rms_tsk->pid == pid && rms_tsk->file == NULL) {
+			mutex_unlock(&rms_task_list_lock);
+			return rms_tsk;
+		}
 	mutex_unlock(&rms_task_list_lock);
-	if (rms_tsk == NULL) {
-		/* Process requesting not registered */
-		return;
-	}
-	if (rms_tsk->deadline_jiff == 0) {
+	return NULL;
+}
+
+/* 
+ * Ends the current job of the task: sets it SLEEPING, arms
+ * the wakeup timer for the beginning of the next period and
+ * lets another task run. Returns 0 if the next period has
+ * already started, and the task should just go on, or 1 if
+ * the task is to sleep until it is dispatched again. wait
+ * tells whether the task waits for that in the yield ioctl.
+ */
+static int deschedule_task(struct rms_task_struct *rms_tsk, bool wait) 
+{
+	struct rms_cpu *rc;
+	unsigned long flags;
+	ktime_t now;
+
+	rc = task_rms_cpu(rms_tsk);
+	now = ktime_get();
+	raw_spin_lock_irqsave(&rc->lock, flags);
+	/* The deadline is the key of the ready queue with EDF */
+	dequeue_ready(rms_tsk);
+	if (rms_tsk->deadline == 0) {
 		/* The task is just newly registered */
-		rms_tsk->deadline_jiff = jiffies;
+		rms_tsk->deadline = now;
 	}
-	rms_tsk->deadline_jiff += msecs_to_jiffies(rms_tsk->period_ms);
-	if (rms_tsk->deadline_jiff < jiffies) {
+	rms_tsk->deadline = ktime_add_us(rms_tsk->deadline, rms_tsk->period_us);
+	if (ktime_before(rms_tsk->deadline, now)) {
 		/* 
 		 * The next period has already started.
 		 * Do nothing.
 		 */
-		return;
+		if (rms_tsk->state == READY)
+			enqueue_ready(rms_tsk);
+		raw_spin_unlock_irqrestore(&rc->lock, flags);
+		return 0;
 	}
 	rms_tsk->state = SLEEPING;
-	mutex_lock(&curr_task_ptr_lock);
-	curr_rms_task = NULL;
-	mutex_unlock(&curr_task_ptr_lock);
-	mod_timer(&rms_tsk->wakeup_timer, rms_tsk->deadline_jiff);
-	wake_up_process(dispatch_thread);
-	set_task_state(rms_tsk->task, TASK_UNINTERRUPTIBLE);
+	rms_tsk->waiting = wait;
+	mark_stale(rms_tsk);
+	if (rc->curr == rms_tsk)
+		rc->curr = NULL;
+	dispatch(rc);
+	raw_spin_unlock_irqrestore(&rc->lock, flags);
+	/* 
+	 * The timer is pinned to the CPU of the task, which
+	 * is the one arming it.
+	 */
+	hrtimer_start(&rms_tsk->wakeup_timer, rms_tsk->deadline,
+				  HRTIMER_MODE_ABS_PINNED_HARD);
+	/* 
+	 * This is process context, so the policies are updated
+	 * right here instead of by the dispatching thread.
+	 */
+	sync_prios(rc);
+	return 1;
 }
 
-static void deregister_task(char *msg)
+/* 
+ * Takes the task off its CPU and frees it. The task, if it
+ * still exists, gets SCHED_NORMAL and its former affinity back.
+ * Needs rms_task_list_lock.
+ */
+static void free_rms_task(struct rms_task_struct *rms_tsk)
+{
+	struct rms_cpu *rc = task_rms_cpu(rms_tsk);
+	struct sched_attr attr;
+	unsigned long flags;
+
+	list_del(&rms_tsk->list);
+	list_del(&rms_tsk->cpu_list);
+	rc->util -= (rms_tsk->runtime_us << SHIFT_AMOUNT) / rms_tsk->period_us;
+	hrtimer_cancel(&rms_tsk->wakeup_timer);
+	/* 
+	 * The timer can no longer queue it, and no policy update
+	 * can be under way while prio_lock is held.
+	 */
+	mutex_lock(&rc->prio_lock);
+	raw_spin_lock_irqsave(&rc->lock, flags);
+	dequeue_ready(rms_tsk);
+	list_del_init(&rms_tsk->stale_node);
+	if (rc->curr == rms_tsk) {
+		/* Let the next task run */
+		rc->curr = NULL;
+		dispatch(rc);
+	}
+	raw_spin_unlock_irqrestore(&rc->lock, flags);
+	/* 
+	 * The task is held by the reference, and the pid may be of
+	 * another namespace than the caller's.
+	 */
+	if (pid_alive(rms_tsk->task)) {
+		memset(&attr, 0, sizeof(attr));
+		attr.sched_policy = SCHED_NORMAL;
+		sched_setattr_nocheck(rms_tsk->task, &attr);
+		set_cpus_allowed_ptr(rms_tsk->task, &rms_tsk->saved_mask);
+	}
+	__sync_prios(rc);
+	mutex_unlock(&rc->prio_lock);
+	put_task_struct(rms_tsk->task);
+	kmem_cache_free(rms_task_struct_cache, rms_tsk);
+}
+
+static void usr_register(char *msg)
+{
+	struct task_struct *task;
+	unsigned long period_us, runtime_us;
+	int pid;
+
+	if (sscanf(strsep(&msg, ","), "%d", &pid) != 1)
+		return;
+	period_us = parse_us(strsep(&msg, ","));
+	runtime_us = parse_us(strsep(&msg, ","));
+	/* Only callers that may set real-time policies register tasks */
+	if (!capable(CAP_SYS_NICE))
+		return;
+	task = get_task_by_pid(pid);
+	if (task) {
+		register_task(task, pid, period_us, runtime_us, NULL);
+		put_task_struct(task);
+	}
+}
+
+/* Deschedule the task that sent the YIELD message */
+static void usr_yield(char *msg)
+{
+	struct rms_task_struct *rms_tsk;
+	int pid;
+
+	sscanf(msg, "%d", &pid);
+	rms_tsk = find_rms_task(pid);
+	if (rms_tsk == NULL) {
+		/* Process requesting not registered */
+		return;
+	}
+	if (deschedule_task(rms_tsk, false))
+		set_task_state(rms_tsk->task, TASK_UNINTERRUPTIBLE);
+}
+
+static void usr_deregister(char *msg)
 {
 	struct rms_task_struct *rms_tsk, *temp;
 	int pid;
@@ -286,11 +940,8 @@ static void deregister_task(char *msg)
 	sscanf(msg, "%d", &pid);
 	mutex_lock(&rms_task_list_lock); 
 	list_for_each_entry_safe(rms_tsk, temp, &rms_task_list, list)
-		if (rms_tsk->pid == pid) {
-			list_del(&rms_tsk->list);
-			del_timer_sync(&rms_tsk->wakeup_timer);
-			kmem_cache_free(rms_task_struct_cache, rms_tsk);
-		}
+		if (rms_tsk->pid == pid && rms_tsk->file == NULL)
+			free_rms_task(rms_tsk);
 	mutex_unlock(&rms_task_list_lock);
 }
 
@@ -313,14 +964,14 @@ static ssize_t usr_write(struct file *file,
 	kbuf[count-1] = '\0'; 
 	switch (kbuf[0]) {
 	case REGISTERATION:
-		register_task(kbuf + 3);
+		usr_register(kbuf + 3);
 		break;
 	case YIELD:
 		/* the YIELD handler */
-		deschedule_task(kbuf+3); 
+		usr_yield(kbuf+3); 
 		break;
 	case DEREGISTRATION:
-		deregister_task(kbuf+3);
+		usr_deregister(kbuf+3);
 		break;
 	default:
 		printk(KERN_ALERT "error: write: invalid message type\n");
@@ -337,34 +988,210 @@ static ssize_t usr_write(struct file *file,
 /* Use proc_ops instead of file_operations on version >= 5.6 */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
 static const struct proc_ops rms_file = {
-	.proc_read = usr_read,
+	.proc_open = usr_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
 	.proc_write = usr_write,
 };
 #else
 static const struct file_operations rms_file = {
 	.owner = THIS_MODULE,
-	.read = usr_read,
+	.open = usr_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
 	.write = usr_write,
 };
 #endif
 
+/* 
+ * Blocks the caller, whose job was just descheduled, until the
+ * dispatching thread lets it run again in a later period.
+ */
+static int wait_dispatched(struct rms_task_struct *rms_tsk)
+{
+	struct rms_cpu *rc = task_rms_cpu(rms_tsk);
+	unsigned long flags;
+
+	for (;;) {
+		set_current_state(TASK_KILLABLE);
+		if (READ_ONCE(rms_tsk->state) == RUNNING)
+			break;
+		if (fatal_signal_pending(current)) {
+			__set_current_state(TASK_RUNNING);
+			raw_spin_lock_irqsave(&rc->lock, flags);
+			rms_tsk->waiting = false;
+			raw_spin_unlock_irqrestore(&rc->lock, flags);
+			return -EINTR;
+		}
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	/* 
+	 * Woken up at DISPATCH_PRIO, the task has preempted the
+	 * one running before, and updates the policies of both.
+	 */
+	sync_prios(rc);
+	return 0;
+}
+
+/* Returns the task the caller registered through the file, or NULL */
+static struct rms_task_struct *dev_task(struct file *file)
+{
+	struct rms_task_struct *rms_tsk;
+
+	mutex_lock(&rms_dev_lock);
+	rms_tsk = file->private_data;
+	if (rms_tsk && rms_tsk->task != current)
+		rms_tsk = NULL;
+	mutex_unlock(&rms_dev_lock);
+	return rms_tsk;
+}
+
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct rms_task_struct *rms_tsk;
+	struct rms_ioc_reg reg;
+
+	switch (cmd) {
+	case RMS_IOC_REGISTER:
+		/* The task is to run as SCHED_FIFO, as if it set that itself */
+		if (!capable(CAP_SYS_NICE))
+			return -EPERM;
+		if (copy_from_user(&reg, (void __user *)arg, sizeof(reg)))
+			return -EFAULT;
+		if (reg.period_us > ULONG_MAX || reg.runtime_us > ULONG_MAX)
+			return -EINVAL;
+		mutex_lock(&rms_dev_lock);
+		if (file->private_data) {
+			mutex_unlock(&rms_dev_lock);
+			return -EEXIST;
+		}
+		rms_tsk = register_task(current, task_pid_vnr(current),
+								reg.period_us, reg.runtime_us, file);
+		if (!IS_ERR(rms_tsk))
+			file->private_data = rms_tsk;
+		mutex_unlock(&rms_dev_lock);
+		return PTR_ERR_OR_ZERO(rms_tsk);
+	case RMS_IOC_YIELD:
+		/* 
+		 * Only the caller itself can deregister the task,
+		 * so it stays around until this returns.
+		 */
+		rms_tsk = dev_task(file);
+		if (rms_tsk == NULL)
+			return -EINVAL;
+		if (!deschedule_task(rms_tsk, true))
+			return 0;
+		return wait_dispatched(rms_tsk);
+	case RMS_IOC_DEREGISTER:
+		mutex_lock(&rms_dev_lock);
+		rms_tsk = file->private_data;
+		if (rms_tsk == NULL || rms_tsk->task != current) {
+			mutex_unlock(&rms_dev_lock);
+			return -EINVAL;
+		}
+		file->private_data = NULL;
+		mutex_lock(&rms_task_list_lock);
+		free_rms_task(rms_tsk);
+		mutex_unlock(&rms_task_list_lock);
+		mutex_unlock(&rms_dev_lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Closing the file deregisters the task registered through it */
+static int dev_release(struct inode *inode, struct file *file)
+{
+	struct rms_task_struct *rms_tsk;
+
+	rms_tsk = file->private_data;
+	if (rms_tsk) {
+		mutex_lock(&rms_task_list_lock);
+		free_rms_task(rms_tsk);
+		mutex_unlock(&rms_task_list_lock);
+	}
+	return 0;
+}
+
+static const struct file_operations rms_dev_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = dev_release,
+};
+
+static struct miscdevice rms_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = DEVICE,
+	.fops = &rms_dev_fops,
+	.mode = 0666,
+};
+
+/* Frees all of the objects in the task list */
+static void free_tasks(void)
+{
+	struct rms_task_struct *rms_tsk, *temp;
+
+	mutex_lock(&rms_task_list_lock);
+	list_for_each_entry_safe(rms_tsk, temp, &rms_task_list, list)
+		free_rms_task(rms_tsk);
+	mutex_unlock(&rms_task_list_lock);
+}
+
+static void stop_dispatchers(void)
+{
+	struct rms_cpu *rc;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		rc = per_cpu_ptr(&rms_cpus, cpu);
+		if (rc->dispatch_thread)
+			kthread_stop(rc->dispatch_thread);
+		rc->dispatch_thread = NULL;
+	}
+}
+
 int __init rms_init(void)
 {
+	struct task_struct *thread;
+	struct rms_cpu *rc;
+	int cpu;
+
 	#ifdef DEBUG
 	printk(KERN_INFO "RMS MODULE LOADING\n");
 	#endif
 
-	/* Create the proc filesystem entries: rms/ and rms/status */
-	proc_dir = proc_mkdir(DIRECTORY, NULL);
-	if (proc_dir == NULL) {
-		printk(KERN_ALERT "error: proc_mkdir failed\n");
-		return -ENOMEM;
+	if (sysfs_streq(policy, "rms")) {
+		sched_mode = POLICY_RMS;
+	} else if (sysfs_streq(policy, "edf")) {
+		sched_mode = POLICY_EDF;
+	} else {
+		printk(KERN_ALERT "error: invalid policy %s\n", policy);
+		return -EINVAL;
 	}
-	proc_entry = proc_create(FILENAME, 0666, proc_dir, &rms_file);
-	if (proc_entry == NULL) {
-		printk(KERN_ALERT "error: proc_create failed\n");
-		return -ENOMEM;
+	if (sysfs_streq(admission, "ll")) {
+		admission_mode = ADMIT_LL;
+	} else if (sysfs_streq(admission, "hyperbolic")) {
+		admission_mode = ADMIT_HYPERBOLIC;
+	} else if (sysfs_streq(admission, "rta")) {
+		admission_mode = ADMIT_RTA;
+	} else {
+		printk(KERN_ALERT "error: invalid admission test %s\n", admission);
+		return -EINVAL;
+	}
+	if (sysfs_streq(placement, "ff")) {
+		placement_mode = PLACE_FIRST_FIT;
+	} else if (sysfs_streq(placement, "wf")) {
+		placement_mode = PLACE_WORST_FIT;
+	} else {
+		printk(KERN_ALERT "error: invalid placement %s\n", placement);
+		return -EINVAL;
 	}
+
 	/* Set up the cache for slab allocator of rms_task_struct */
 	rms_task_struct_cache = kmem_cache_create("RMS Slab Alloc Cache", 
 		sizeof(struct rms_task_struct), 0, SLAB_HWCACHE_ALIGN, NULL); 
@@ -372,12 +1199,57 @@ int __init rms_init(void)
 		printk(KERN_ALERT "error: kmem_cache_create failed\n");
 		return -ENOMEM;
 	}
-	/* Create and wake up a thread that triggers context switches */
-	dispatch_thread = kthread_run(dispatch_thread_fn, NULL, 
-								  "RMS Dispatching Thread");
-	if (IS_ERR(dispatch_thread)) {
-		printk(KERN_ALERT "error: kthread_create failed\n");
-		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		rc = per_cpu_ptr(&rms_cpus, cpu);
+		INIT_LIST_HEAD(&rc->tasks);
+		raw_spin_lock_init(&rc->lock);
+		rc->ready_tree = RB_ROOT_CACHED;
+		INIT_LIST_HEAD(&rc->stale);
+		mutex_init(&rc->prio_lock);
+	}
+	/* 
+	 * Create and wake up a thread that triggers context switches
+	 * on every online CPU, bound to that CPU.
+	 */
+	for_each_online_cpu(cpu) {
+		rc = per_cpu_ptr(&rms_cpus, cpu);
+		thread = kthread_create_on_cpu(dispatch_thread_fn, rc, cpu,
+									   "RMS Dispatching Thread/%u");
+		if (IS_ERR(thread)) {
+			printk(KERN_ALERT "error: kthread_create failed\n");
+			goto err_dispatchers;
+		}
+		rc->dispatch_thread = thread;
+		wake_up_process(thread);
+	}
+	/* 
+	 * Hook task exit, so that a task exiting while registered 
+	 * doesn't hold its CPU. The tracepoint is not exported to
+	 * modules, so look it up among the kernel's tracepoints.
+	 */
+	for_each_kernel_tracepoint(find_tps, NULL);
+	if (exit_tp == NULL ||
+		tracepoint_probe_register(exit_tp, probe_task_exit, NULL)) {
+		printk(KERN_ALERT "error: tracepoint_probe_register failed\n");
+		goto err_dispatchers;
+	}
+	/* 
+	 * Create rms/status and /dev/rms last, as tasks can register
+	 * as soon as they appear.
+	 */
+	proc_dir = proc_mkdir(DIRECTORY, NULL);
+	if (proc_dir == NULL) {
+		printk(KERN_ALERT "error: proc_mkdir failed\n");
+		goto err_exit_tp;
+	}
+	proc_entry = proc_create(FILENAME, 0666, proc_dir, &rms_file);
+	if (proc_entry == NULL) {
+		printk(KERN_ALERT "error: proc_create failed\n");
+		goto err_proc_entry;
+	}
+	if (misc_register(&rms_dev)) {
+		printk(KERN_ALERT "error: misc_register failed\n");
+		goto err_misc;
 	}
 
 	#ifdef DEBUG
@@ -385,12 +1257,25 @@ int __init rms_init(void)
 	#endif
 	
 	return 0;
+
+	/* Undo the steps above in reverse order */
+err_misc:
+	remove_proc_entry(FILENAME, proc_dir);
+err_proc_entry:
+	remove_proc_entry(DIRECTORY, NULL);
+err_exit_tp:
+	tracepoint_probe_unregister(exit_tp, probe_task_exit, NULL);
+	tracepoint_synchronize_unregister();
+err_dispatchers:
+	/* Tasks may have registered through rms/status meanwhile */
+	free_tasks();
+	stop_dispatchers();
+	kmem_cache_destroy(rms_task_struct_cache);
+	return -ENOMEM;
 }
 
 void __exit rms_exit(void)
 {
-	struct rms_task_struct *rms_tsk, *temp;
-
 	#ifdef DEBUG
 	printk(KERN_INFO "RMS MODULE UNLOADING\n");
 	#endif
@@ -398,16 +1283,20 @@ void __exit rms_exit(void)
 	/* Remove the proc filesystem entries created in init */
 	remove_proc_entry(FILENAME, proc_dir);
 	remove_proc_entry(DIRECTORY, NULL);
-	/* Free all of the objects in the task list */
-	list_for_each_entry_safe(rms_tsk, temp, &rms_task_list, list) {
-			list_del(&rms_tsk->list);
-			del_timer_sync(&rms_tsk->wakeup_timer);
-			kmem_cache_free(rms_task_struct_cache, rms_tsk);
-	}
+	misc_deregister(&rms_dev);
+	/* Stop the exit hook and wait until running probes return */
+	tracepoint_probe_unregister(exit_tp, probe_task_exit, NULL);
+	tracepoint_synchronize_unregister();
+	/* 
+	 * Free all of the objects in the task list first, which
+	 * cancels their timers, so that no timer can kick a 
+	 * dispatching thread once it is stopped.
+	 */
+	free_tasks();
+	/* Stop the dispatching functions */
+	stop_dispatchers();
 	/* Destroy the cache set up for slab allocator */
 	kmem_cache_destroy(rms_task_struct_cache);
-	/* Stop the dispatching function */
-	kthread_stop(dispatch_thread);
 
 	#ifdef DEBUG
 	printk(KERN_INFO "RMS MODULE UNLOADED\n");
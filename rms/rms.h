@@ -1,13 +1,51 @@
 #ifndef __RMS_H__
 #define __RMS_H__
 
+#ifndef __KERNEL__
+#include <linux/types.h>
+#endif
+#include <linux/ioctl.h>
+
 #define FILENAME       "status"
 #define DIRECTORY      "rms"
+#define DEVICE         "rms"
 #define REGISTERATION  'R'
 #define YIELD		   'Y'
 #define DEREGISTRATION 'D'
 
+/* 
+ * Binary interface through ioctl() on /dev/rms. A task registers
+ * itself (i.e., the calling thread) with RMS_IOC_REGISTER, and the
+ * open file then stands for it: RMS_IOC_YIELD ends its current job
+ * and blocks until the task is dispatched in a later period, and
+ * RMS_IOC_DEREGISTER, or closing the file, deregisters it. The
+ * ioctls fail with EEXIST if the task is already registered,
+ * EBUSY if it doesn't pass the admission control, EPERM if the
+ * caller lacks CAP_SYS_NICE and EINVAL if the file has no task
+ * registered through it by the caller.
+ */
+struct rms_ioc_reg {
+	__u64 period_us;
+	__u64 runtime_us;
+};
+
+#define RMS_IOC_MAGIC 'r'
+#define RMS_IOC_REGISTER _IOW(RMS_IOC_MAGIC, 1, struct rms_ioc_reg)
+#define RMS_IOC_YIELD _IO(RMS_IOC_MAGIC, 2)
+#define RMS_IOC_DEREGISTER _IO(RMS_IOC_MAGIC, 3)
+
+#ifdef __KERNEL__
 enum task_state { READY, RUNNING, SLEEPING };
+enum sched_mode { POLICY_RMS, POLICY_EDF };
+enum admission_mode { ADMIT_LL, ADMIT_HYPERBOLIC, ADMIT_RTA };
+enum placement_mode { PLACE_FIRST_FIT, PLACE_WORST_FIT };
+
+/* 
+ * SCHED_FIFO priorities. The dispatching threads run above
+ * the task they let run, so that they can preempt it.
+ */
+#define RMS_PRIO      98
+#define DISPATCH_PRIO 99
 
 /* Defined for fixed-point arithemric, where
  * in this kernel module the fractional part 
@@ -20,5 +58,6 @@ enum task_state { READY, RUNNING, SLEEPING };
 
 #define set_task_state(tsk, state_value)        \
     smp_store_mb((tsk)->__state, (state_value))
+#endif
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <math.h>
+#include "librms.h"
 #include "test_userapp.h"
 
 #define MAX_STR_SIZE 255
@@ -11,22 +12,6 @@
 #define MAX_READ_LEN 999
 
 
-static int register_rms(int pid,
-						char *period_ms,
-						char *runtime_ms)
-{
-	char command[MAX_STR_SIZE];
-
-	memset(command, 0, MAX_STR_SIZE);
-	sprintf(command, "echo \"R, %d, %s, %s\" > /proc/rms/status",
-			pid, period_ms, runtime_ms);
-	if (system(command)) {
-		fprintf(stderr, "System call failed\n");
-		return 1;
-	}
-	return 0;
-}
-
 static int pid_in_list(int nr)
 {
 	FILE *rms;
@@ -48,33 +33,6 @@ static int pid_in_list(int nr)
 	return 0;
 }
 
-static int yield_rms(int pid)
-{
-	char command[MAX_STR_SIZE];
-
-	memset(command, 0, MAX_STR_SIZE);
-	sprintf(command, "echo \"Y, %d\" > /proc/rms/status", pid);
-	if (system(command)) {
-		fprintf(stderr, "system call failed\n");
-		return 1;
-	}
-	return 0;
-
-}
-
-static int deregister_rms(int pid)
-{
-	char command[MAX_STR_SIZE];
-
-	memset(command, 0, MAX_STR_SIZE);
-	sprintf(command, "echo \"D, %d\" > /proc/rms/status", pid);
-	if (system(command)) {
-		fprintf(stderr, "system call failed\n");
-		return 1;
-	}
-	return 0;
-}
-
 static unsigned long timevalsub_ms(struct timeval *t0,
 						      struct timeval *t1)
 {
@@ -101,8 +59,8 @@ static void do_job(unsigned long runtime_ms)
 /* 
  * Takes 3 arguments: 
  *
- * @runtime_ms: execution time of the job in msec
  * @period_ms: period of the job in msec
+ * @runtime_ms: execution time of the job in msec
  * @cycle_nr: number of times the job should execute
  *           
  */
@@ -111,19 +69,24 @@ int main(int argc, char *argv[])
 	struct timeval t0, t1, t2, diff1, diff2;
 	unsigned long wakeup_time, process_time;
 	unsigned long runtime_ms, period_ms;
-	int cycle_nr, pid;
+	int cycle_nr, pid, fd;
 
 	if (argc != 4) {
 		fprintf(stderr, "Invalid Arguments\n");
 		return 1;
 	}
-	runtime_ms = strtoul(argv[1], NULL, 10);
-	period_ms = strtoul(argv[2], NULL, 10);
+	period_ms = strtoul(argv[1], NULL, 10);
+	runtime_ms = strtoul(argv[2], NULL, 10);
 	cycle_nr = atoi(argv[3]);
 
-	/* Register the process with its pid */
+	/* Register the process through /dev/rms */
 	pid = getpid();
-	if (register_rms(pid, argv[1], argv[2])) {
+	fd = rms_open();
+	if (fd < 0) {
+		fprintf(stderr, "Opening /dev/rms failed\n");
+		return 1;
+	}
+	if (rms_register(fd, period_ms * 1000, runtime_ms * 1000)) {
 		fprintf(stderr, "Registeration failed\n");
 		return 1;
 	} 
@@ -141,7 +104,7 @@ int main(int argc, char *argv[])
 	 * Everything is set. Yield at this point and let 
 	 * the RMS module take care of scheduling.
 	 */
-	if (yield_rms(pid)) {
+	if (rms_yield(fd)) {
 		fprintf(stderr, "Yield request failed\n");
 		return 1;
 	}
@@ -164,17 +127,18 @@ int main(int argc, char *argv[])
 		 * Yield again to allow the RMS module to schedule
 		 * the other tasks.
 		 */
-		if (yield_rms(pid)) {
+		if (rms_yield(fd)) {
 			fprintf(stderr, "Yield request failed\n");
 			break;
 		}
 	}
 
-	/* Deregister the process with its pid */
-	if (deregister_rms(pid)) {
+	/* Deregister the process */
+	if (rms_deregister(fd)) {
 		fprintf(stderr, "De-registeration failed\n");
 		return 1;
 	}
+	rms_close(fd);
 
 	return 0;
 }
\ No newline at end of file
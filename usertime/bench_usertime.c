@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "usertime.h"
+
+/*
+ * Benchmark of the usertime module. It spawns nprocs worker
+ * processes and prints CSV rows of "metric,nprocs,value,unit" to
+ * stdout:
+ *   register_text/deregister_text   - processes per second, one
+ *                                     write() per process
+ *   register_ioctl/deregister_ioctl - processes per second, one
+ *                                     batch ioctl() for all of them
+ *   status_read                     - latency of reading the whole
+ *                                     status file, by registry size
+ *   status_read_delta               - latency of a delta read right
+ *                                     after a full one
+ *   lateness/work/pass/lock_hold    - average costs of the sampling
+ *                                     passes from debugfs
+ * The module must be loaded; the pass costs need debugfs mounted.
+ */
+
+#define STATUS "/proc/" DIRECTORY "/" FILENAME
+#define DBG_STATS "/sys/kernel/debug/" DIRECTORY "/stats"
+#define INTERVAL_PARAM "/sys/module/usertime/parameters/interval"
+#define NPROCS 1024
+#define PASSES 20
+#define READS 10
+#define MAX_STR_SIZE 255
+
+static pid_t *workers;
+static int nprocs = NPROCS;
+static char *rbuf;
+static size_t rbuf_size;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Workers wake up every 10 msecs and burn a little CPU, so that
+ * their CPU time changes between the sampling passes.
+ */
+static void worker(void)
+{
+	volatile unsigned long spin;
+
+	for (;;) {
+		for (spin = 0; spin < 10000; spin++)
+			;
+		usleep(10000);
+	}
+}
+
+static int spawn_workers(void)
+{
+	int i;
+
+	workers = calloc(nprocs, sizeof(pid_t));
+	if (workers == NULL) {
+		/* There are no workers for kill_workers() to reap */
+		nprocs = 0;
+		return 1;
+	}
+	for (i = 0; i < nprocs; i++) {
+		workers[i] = fork();
+		if (workers[i] < 0) {
+			perror("fork");
+			nprocs = i;
+			return 1;
+		}
+		if (workers[i] == 0)
+			worker();
+	}
+	return 0;
+}
+
+static void kill_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nprocs; i++)
+		kill(workers[i], SIGKILL);
+	for (i = 0; i < nprocs; i++)
+		waitpid(workers[i], NULL, 0);
+}
+
+static void row(const char *metric, int n, double value, const char *unit)
+{
+	printf("%s,%d,%.3f,%s\n", metric, n, value, unit);
+	fflush(stdout);
+}
+
+/* Registers (or deregisters with a '-') the workers one write() each */
+static double text_batch(int fd, int n, int dereg)
+{
+	char msg[MAX_MSG_LEN];
+	double start;
+	int i, len;
+
+	start = now_us();
+	for (i = 0; i < n; i++) {
+		len = snprintf(msg, sizeof(msg), "%s%d", dereg ? "-" : "",
+					   workers[i]);
+		if (write(fd, msg, len) != len) {
+			perror("write");
+			return -1;
+		}
+	}
+	return now_us() - start;
+}
+
+/* Registers or deregisters the workers from..n-1 with one ioctl() */
+static double ioctl_batch(int fd, int from, int n, unsigned long cmd)
+{
+	struct usrt_batch_ent *ents;
+	struct usrt_batch batch;
+	double start, elapsed;
+	int i;
+
+	ents = calloc(n - from, sizeof(struct usrt_batch_ent));
+	if (ents == NULL)
+		return -1;
+	for (i = from; i < n; i++)
+		ents[i - from].pid = workers[i];
+	batch.nr = n - from;
+	batch.reserved = 0;
+	batch.ents = (__u64)(unsigned long)ents;
+	start = now_us();
+	if (ioctl(fd, cmd, &batch)) {
+		perror("ioctl");
+		free(ents);
+		return -1;
+	}
+	elapsed = now_us() - start;
+	for (i = 0; i < n - from; i++)
+		if (ents[i].status && !(cmd == USRT_IOC_DEREGISTER &&
+								ents[i].status == -ENOENT))
+			fprintf(stderr, "pid %d: status %d\n", ents[i].pid,
+					ents[i].status);
+	free(ents);
+	return elapsed;
+}
+
+/* Reads the status file from the start to the end */
+static ssize_t read_status(int fd)
+{
+	ssize_t len, total;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+	total = 0;
+	while ((len = read(fd, rbuf, rbuf_size)) > 0)
+		total += len;
+	return len < 0 ? len : total;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Median latency of READS reads of the status file in usecs */
+static double status_latency(int fd)
+{
+	double lat[READS], start;
+	int i;
+
+	for (i = 0; i < READS; i++) {
+		start = now_us();
+		if (read_status(fd) < 0) {
+			perror("read");
+			return -1;
+		}
+		lat[i] = now_us() - start;
+	}
+	qsort(lat, READS, sizeof(double), cmp_double);
+	return lat[READS / 2];
+}
+
+static void bench_registration(int fd)
+{
+	double us;
+
+	us = text_batch(fd, nprocs, 0);
+	if (us > 0)
+		row("register_text", nprocs, nprocs / us * 1e6, "procs/s");
+	us = text_batch(fd, nprocs, 1);
+	if (us > 0)
+		row("deregister_text", nprocs, nprocs / us * 1e6, "procs/s");
+	us = ioctl_batch(fd, 0, nprocs, USRT_IOC_REGISTER);
+	if (us > 0)
+		row("register_ioctl", nprocs, nprocs / us * 1e6, "procs/s");
+	us = ioctl_batch(fd, 0, nprocs, USRT_IOC_DEREGISTER);
+	if (us > 0)
+		row("deregister_ioctl", nprocs, nprocs / us * 1e6, "procs/s");
+}
+
+/* Status read latency at registry sizes 1, 2, 4, ... up to nprocs */
+static void bench_status_read(int fd)
+{
+	char since[MAX_STR_SIZE], head[MAX_STR_SIZE];
+	unsigned long long seq;
+	ssize_t len;
+	double start;
+	int delta, n, prev;
+
+	prev = 0;
+	for (n = 1; prev < nprocs; n *= 2) {
+		if (n > nprocs)
+			n = nprocs;
+		if (ioctl_batch(fd, prev, n, USRT_IOC_REGISTER) < 0)
+			return;
+		prev = n;
+		row("status_read", n, status_latency(fd), "us");
+		/* 
+		 * A delta read on a file of its own, since the sequence
+		 * number that its first line reports.
+		 */
+		delta = open(STATUS, O_RDWR);
+		len = -1;
+		if (delta >= 0 && write(delta, "since 0", 7) == 7)
+			len = read(delta, head, sizeof(head) - 1);
+		if (len > 0)
+			head[len] = '\0';
+		if (len <= 0 || sscanf(head, "seq: %llu", &seq) != 1) {
+			fprintf(stderr, "delta reads not available\n");
+		} else {
+			snprintf(since, sizeof(since), "since %llu", seq);
+			start = now_us();
+			if (write(delta, since, strlen(since)) > 0 &&
+				read_status(delta) >= 0)
+				row("status_read_delta", n, now_us() - start, "us");
+		}
+		if (delta >= 0)
+			close(delta);
+	}
+}
+
+/*
+ * Lets PASSES sampling passes run with every worker registered, and
+ * reports the averages of the histograms in debugfs.
+ */
+static void bench_passes(void)
+{
+	static const char *hists[] = { "lateness", "work", "pass", "lock_hold" };
+	char line[MAX_STR_SIZE], name[MAX_STR_SIZE];
+	unsigned long long count, avg;
+	unsigned int interval, i;
+	size_t len;
+	FILE *f;
+
+	f = fopen(INTERVAL_PARAM, "r");
+	if (f == NULL || fscanf(f, "%u", &interval) != 1)
+		interval = INTERVAL;
+	if (f)
+		fclose(f);
+	f = fopen(DBG_STATS, "w");
+	if (f == NULL) {
+		fprintf(stderr, "%s not available, skipping pass costs\n", DBG_STATS);
+		return;
+	}
+	fputs("0\n", f);
+	fclose(f);
+	usleep((useconds_t)interval * 1000 * PASSES);
+	f = fopen(DBG_STATS, "r");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		/* Histograms read "<name>_ns: count <count> avg <avg>" */
+		if (sscanf(line, "%254[a-z_]: count %llu avg %llu",
+				   name, &count, &avg) != 3)
+			continue;
+		len = strlen(name);
+		if (len > 3 && !strcmp(name + len - 3, "_ns"))
+			name[len - 3] = '\0';
+		for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++)
+			if (!strcmp(name, hists[i]) && count)
+				row(name, nprocs, avg, "ns");
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, fd, ret;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nprocs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n nprocs]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nprocs <= 0 || nprocs > USRT_BATCH_MAX) {
+		fprintf(stderr, "nprocs must be between 1 and %d\n", USRT_BATCH_MAX);
+		return 1;
+	}
+	fd = open(STATUS, O_RDWR);
+	if (fd < 0) {
+		perror(STATUS);
+		return 1;
+	}
+	rbuf_size = 1 << 20;
+	rbuf = malloc(rbuf_size);
+	if (rbuf == NULL)
+		return 1;
+	ret = 0;
+	if (spawn_workers()) {
+		fprintf(stderr, "Spawning the workers failed\n");
+		ret = 1;
+		goto out;
+	}
+	printf("metric,nprocs,value,unit\n");
+	bench_registration(fd);
+	bench_status_read(fd);
+	bench_passes();
+	ioctl_batch(fd, 0, nprocs, USRT_IOC_DEREGISTER);
+out:
+	kill_workers();
+	close(fd);
+	free(rbuf);
+	free(workers);
+	return ret;
+}
@@ -4,38 +4,500 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
-#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/kstrtox.h>
-#include <linux/jiffies.h>
-#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
 #include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/sched.h>
+#include <linux/llist.h>
+#include <linux/tracepoint.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/cgroup.h>
+#include <linux/sched/signal.h>
+#include <linux/capability.h>
+#include <linux/ptrace.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <net/genetlink.h>
 #include "usertime.h"
 
 static struct proc_dir_entry *proc_dir;
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *snap_entry;
+static struct proc_dir_entry *grp_entry;
+static struct proc_dir_entry *top_entry;
 
-static LIST_HEAD(cput_list);
+static bool lazy;
+module_param(lazy, bool, 0444);
+MODULE_PARM_DESC(lazy, "Sample the CPU times when status is read "
+				 "instead of periodically");
+
+static unsigned int interval = INTERVAL;
+static int set_interval(const char *val, const struct kernel_param *kp);
+static const struct kernel_param_ops interval_ops = {
+	.set = set_interval,
+	.get = param_get_uint,
+};
+module_param_cb(interval, &interval_ops, &interval, 0644);
+MODULE_PARM_DESC(interval, "Default sampling period in msecs");
+
+static unsigned int snapshot_slots = SNAPSHOT_SLOTS;
+module_param(snapshot_slots, uint, 0444);
+MODULE_PARM_DESC(snapshot_slots, "Number of records in usrt/snapshot, at "
+				 "most " __stringify(SNAPSHOT_SLOTS_MAX));
+
+static unsigned int topk = TOPK;
+module_param(topk, uint, 0444);
+MODULE_PARM_DESC(topk, "Number of processes in usrt/top, at most "
+				 __stringify(TOPK_MAX));
+
+static int budget_signal = SIGXCPU;
+module_param(budget_signal, int, 0644);
+MODULE_PARM_DESC(budget_signal, "Signal sent to a process over its CPU "
+				 "budget, or 0 to run it as SCHED_IDLE until its window "
+				 "resets");
+
+/* 
+ * Registered processes are indexed by their pid, so registering,
+ * deregistering and looking up one process does not depend on
+ * how many processes are registered. The index is the pid in the
+ * initial pid namespace, which is also what the exit hook sees,
+ * and each entry pins the struct pid of its process so that a
+ * recycled pid can never be mistaken for the registered process.
+ *
+ * The registry is split by pid hash into shards, one or more per
+ * CPU. Each shard has its own lock and its own work item, so the
+ * shards are sampled in parallel and a reader or writer only ever
+ * waits for the shard it works on.
+ */
+struct cput_work {
+	struct work_struct work;
+	struct cput_shard *shard;
+	unsigned int bucket;
+};
+
+/* Samples of the current pass waiting to be multicast */
+struct cput_staged {
+	struct usrt_nl_sample *samples;
+	unsigned int len;
+	unsigned int cap;
+};
+
+/* 
+ * Processes ranked by their CPU usage over their last sampling
+ * period. Each shard keeps, for every bucket, the candidates for the
+ * topk processes of its last pass in an array with room for twice as
+ * many. When it fills up, it is sorted and cut back to the topk 
+ * heaviest, whose lightest one then sets the usage that the next
+ * candidates must exceed. The arrays are merged into usrt/top the
+ * same way whenever a pass completes.
+ */
+struct cput_top {
+	unsigned int pid;
+	/* CPU usage in basis points */
+	u32 usage;
+	/* CPU time in nsecs */
+	u64 delta;
+};
+
+struct cput_topk {
+	struct cput_top *rows;
+	unsigned int nr;
+	/* Whether topk rows were kept, and the usage of the lightest */
+	bool full;
+	u32 floor;
+};
+
+struct cput_shard {
+	struct mutex lock;
+	struct xarray xa;
+	/* 
+	 * The same entries, indexed by the sequence number of their
+	 * change, and the pids removed from the shard as value entries
+	 */
+	struct xarray by_seq;
+	/* Sequence number of the removal marker of each pid in by_seq */
+	struct xarray gone;
+	unsigned int nr_gone;
+	/* Entries of the shard, by sampling bucket */
+	struct list_head lists[MAX_BUCKETS];
+	struct cput_work works[MAX_BUCKETS];
+	struct cput_staged staged[MAX_BUCKETS];
+	struct cput_topk top[MAX_BUCKETS];
+	/* Pass that filled each top array */
+	u64 top_gen[MAX_BUCKETS];
+} ____cacheline_aligned_in_smp;
+static struct cput_shard *shards;
+static unsigned int shard_bits;
+static unsigned int nr_shards;
+static atomic_t nr_cput = ATOMIC_INIT(0);
+/* Processes registered or deregistered at a time by a batch */
+#define REG_CHUNK 32
+/* 
+ * The sequence number of a change is the sampling pass that found
+ * it, so marking a change needs no counter shared by the shards.
+ * An entry is kept in by_seq under its sequence number followed by
+ * its pid, which is unique among the entries changed by one pass.
+ */
+#define SEQ_PID_BITS 22
+
+static inline unsigned long seq_index(u64 seq, unsigned int pid)
+{
+	/* The sequence number needs the upper bits of a long */
+	BUILD_BUG_ON(BITS_PER_LONG < 64);
+	BUILD_BUG_ON(PID_MAX_LIMIT > 1 << SEQ_PID_BITS);
+	return seq << SEQ_PID_BITS | pid;
+}
+
+/* 
+ * Removed pids stay in by_seq as markers, so that delta reads report
+ * them, until the pid registers again. Each shard keeps at most
+ * GONE_MAX of them, and drops the older half when it has more. Delta
+ * reads since a sequence number before the latest marker dropped
+ * fail, as they would miss removals.
+ */
+#define GONE_MAX 4096
+static atomic64_t gone_floor = ATOMIC64_INIT(0);
+
+/* 
+ * Each entry keeps its last RING_SIZE samples of the CPU time in a
+ * ring, allocated once with the entry from a cache-aligned slab, to
+ * report its CPU usage over time windows without any help from
+ * userspace.
+ */
+struct cput_sample {
+	u64 time;
+	u64 cpu;
+};
+
+struct cput_ring {
+	unsigned int head;
+	unsigned int count;
+	struct cput_sample samples[RING_SIZE];
+};
+static struct kmem_cache *cput_ring_cache;
+
+/* 
+ * The shard lock only serializes the writers of the registry. The
+ * status file walks it under RCU, and reads the samples of an entry
+ * under the seqlock that they are written with.
+ */
 struct cput_entry {
 	unsigned int pid;
-	unsigned long time;
-	struct list_head list;
+	struct pid *kpid;
+	seqlock_t lock;
+	struct usrt_stats stats;
+	struct cput_ring *ring;
+	int slot;
+	unsigned int bucket;
+	struct list_head bucket_node;
+	/* Sequence number of the last change of the samples */
+	u64 change_seq;
+	/* 
+	 * CPU budget in nsecs of runtime per window, 0 for none. The
+	 * window starts at window_start, when the runtime was
+	 * window_base. throttle is the signal sent to the process over
+	 * its budget, -1 if it was made SCHED_IDLE, or 0.
+	 */
+	u64 budget_ns;
+	u64 window_ns;
+	u64 window_start;
+	u64 window_base;
+	int throttle;
+	/* Scheduling policy of the process before SCHED_IDLE */
+	int saved_policy;
+	int saved_nice;
+	unsigned int saved_rt_prio;
+	/* Set by whoever takes on removing the entry after exit */
+	unsigned long flags;
+	struct usrt_stats exit_stats;
+	struct llist_node exit_node;
+	struct rcu_head rcu;
+};
+#define CPUT_EXITED 0
+static struct kmem_cache *cput_entry_cache;
+
+/* 
+ * Processes that share a sampling period are sampled together by
+ * the hrtimer of one bucket. Bucket 0 samples every interval msecs
+ * and holds the processes registered without a period of their own;
+ * the other buckets are handed out on demand, one per distinct
+ * period, and are released when their last process leaves.
+ */
+struct cput_bucket {
+	unsigned int period_ms;
+	atomic_t users;
+	struct hrtimer timer;
+	/* Number of shards yet to finish the current sampling pass */
+	atomic_t pending;
+	u64 gen;
+	/* Last completed pass */
+	u64 done_gen;
+	/* Expiry of the timer that started the current pass, in nsecs */
+	u64 expires_ns;
+};
+static struct cput_bucket buckets[MAX_BUCKETS];
+/* Serializes handing out the buckets 1..MAX_BUCKETS-1 */
+static DEFINE_MUTEX(bucket_lock);
+static atomic64_t pass_seq = ATOMIC64_INIT(0);
+
+/* 
+ * Self-instrumentation, always on and shown in debugfs under usrt/.
+ * Every CPU counts events and keeps log2 histograms of latencies in
+ * nsecs on its own, so recording one costs a clock read and a few
+ * per-CPU increments, and the CPUs are only summed up when read.
+ */
+enum {
+	DBG_PASSES,
+	/* Periods skipped because the previous pass was still running */
+	DBG_OVERRUNS,
+	DBG_SAMPLES,
+	DBG_EXITS,
+	NR_DBG_COUNTERS,
 };
 
-static DEFINE_MUTEX(cput_list_lock);
-static struct timer_list ktimer;
+enum {
+	/* Start of a shard's work after the timer expired */
+	DBG_LATENESS,
+	/* Run time of the work of one shard */
+	DBG_WORK,
+	/* Timer expiry to the completion of the pass by the last shard */
+	DBG_PASS,
+	/* Hold time of the shard locks */
+	DBG_LOCK_HOLD,
+	NR_DBG_HISTS,
+};
+
+#define DBG_HIST_BUCKETS 40
+
+struct cput_dbg {
+	u64 counters[NR_DBG_COUNTERS];
+	u64 count[NR_DBG_HISTS];
+	u64 sum[NR_DBG_HISTS];
+	/* Bucket k counts values in [2^k, 2^(k+1)), bucket 0 also 0 */
+	u64 hist[NR_DBG_HISTS][DBG_HIST_BUCKETS];
+};
+static struct cput_dbg __percpu *dbg;
+static struct dentry *dbg_dir;
+
+static const char *const dbg_counter_names[NR_DBG_COUNTERS] = {
+	"passes", "overruns", "samples", "exits",
+};
+static const char *const dbg_hist_names[NR_DBG_HISTS] = {
+	"lateness", "work", "pass", "lock_hold",
+};
+
+static void dbg_count(unsigned int counter)
+{
+	this_cpu_inc(dbg->counters[counter]);
+}
+
+static void dbg_hist(unsigned int hist, u64 ns)
+{
+	unsigned int k = ns ? ilog2(ns) : 0;
+
+	this_cpu_inc(dbg->count[hist]);
+	this_cpu_add(dbg->sum[hist], ns);
+	this_cpu_inc(dbg->hist[hist][min(k, DBG_HIST_BUCKETS - 1U)]);
+}
+
+/* 
+ * Counts completed sampling passes and registry changes. Pollers of
+ * usrt/status sleep on status_wait until it moves past the value
+ * their open file last reported.
+ */
+static atomic64_t status_event = ATOMIC64_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(status_wait);
+
 static struct workqueue_struct *workqueue;
-static struct work_struct work;
+/* Set on unload to stop restarting the bucket timers */
+static bool stopping;
+
+/* Entries of exited processes waiting to be removed */
+static LLIST_HEAD(exit_list);
+static struct work_struct exit_work;
+static struct tracepoint *exit_tp;
+
+/* 
+ * Thread groups and cgroups (v2) are registered through usrt/groups.
+ * Their CPU time is accumulated on the fly, in per-CPU counters, from
+ * the runtime the scheduler accounts to each of their tasks (the
+ * sched_stat_runtime tracepoint). Threads spawned after registration
+ * are covered as well, and nothing walks the threads of a group to
+ * read its CPU time.
+ */
+struct cput_group {
+	/* tgid in the initial pid namespace, or cgroup id */
+	u64 id;
+	/* Thread group leader, or NULL for a cgroup */
+	struct pid *kpid;
+	struct cgroup *cgrp;
+	char *path;
+	/* Runtime of the thread group before its registration */
+	u64 base;
+	u64 __percpu *runtime;
+	unsigned long flags;
+	struct llist_node exit_node;
+	struct rcu_head rcu;
+};
+static DEFINE_XARRAY(tg_xa);
+static DEFINE_XARRAY(cg_xa);
+/* Serializes registering and deregistering the groups */
+static DEFINE_MUTEX(group_lock);
+static atomic_t nr_tgs = ATOMIC_INIT(0);
+static atomic_t nr_cgs = ATOMIC_INIT(0);
+/* Thread groups whose last thread exited, waiting to be removed */
+static LLIST_HEAD(group_exit_list);
+static struct tracepoint *runtime_tp;
+
+/* 
+ * Binary snapshot of the CPU times that userspace maps with
+ * mmap() (see struct usrt_snap_hdr). Each entry owns one record
+ * slot while it is registered, and records are only written
+ * under the lock of the shard of the entry.
+ */
+#define SNAP_SIZE PAGE_ALIGN(sizeof(struct usrt_snap_hdr) + \
+		(size_t)snapshot_slots * sizeof(struct usrt_snap_rec))
+static void *snap_buf;
+static struct usrt_snap_hdr *snap_hdr;
+static struct usrt_snap_rec *snap_recs;
+static DEFINE_IDA(snap_ida);
+static DEFINE_SPINLOCK(snap_lock);
+
+static void snap_store(int slot, unsigned int pid, u64 utime,
+					   u64 stime, u64 sample_seq)
+{
+	struct usrt_snap_rec *rec = &snap_recs[slot];
+
+	/* Odd seq tells the readers the record is being updated */
+	WRITE_ONCE(rec->seq, rec->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(rec->pid, pid);
+	WRITE_ONCE(rec->utime_ns, utime);
+	WRITE_ONCE(rec->stime_ns, stime);
+	WRITE_ONCE(rec->sample_seq, sample_seq);
+	smp_wmb();
+	WRITE_ONCE(rec->seq, rec->seq + 1);
+}
+
+static void snap_alloc_slot(struct cput_entry *entry)
+{
+	/* 
+	 * Entries that find the snapshot full are left out of it, and
+	 * counted in nr_dropped so that readers know it is incomplete.
+	 */
+	entry->slot = ida_alloc_max(&snap_ida, snapshot_slots - 1, GFP_KERNEL);
+	if (entry->slot >= 0)
+		snap_store(entry->slot, entry->pid, 0, 0, 0);
+	spin_lock(&snap_lock);
+	if (entry->slot < 0)
+		WRITE_ONCE(snap_hdr->nr_dropped, snap_hdr->nr_dropped + 1);
+	else if (entry->slot >= snap_hdr->nr_slots)
+		WRITE_ONCE(snap_hdr->nr_slots, entry->slot + 1);
+	spin_unlock(&snap_lock);
+}
+
+static void snap_free_slot(struct cput_entry *entry)
+{
+	if (entry->slot < 0) {
+		spin_lock(&snap_lock);
+		WRITE_ONCE(snap_hdr->nr_dropped, snap_hdr->nr_dropped - 1);
+		spin_unlock(&snap_lock);
+		return;
+	}
+	snap_store(entry->slot, 0, 0, 0, 0);
+	ida_free(&snap_ida, entry->slot);
+}
+
+static void free_cput_entry_rcu(struct rcu_head *rcu)
+{
+	struct cput_entry *entry = container_of(rcu, struct cput_entry, rcu);
+
+	kmem_cache_free(cput_ring_cache, entry->ring);
+	kmem_cache_free(cput_entry_cache, entry);
+}
+
+static struct cput_shard *pid_shard(unsigned int pid)
+{
+	return &shards[hash_32(pid, shard_bits)];
+}
+
+/* Takes the lock of a shard and returns when, to time its hold */
+static u64 lock_shard(struct cput_shard *shard)
+{
+	mutex_lock(&shard->lock);
+	return ktime_get_ns();
+}
+
+static void unlock_shard(struct cput_shard *shard, u64 locked)
+{
+	dbg_hist(DBG_LOCK_HOLD, ktime_get_ns() - locked);
+	mutex_unlock(&shard->lock);
+}
+
+/* 
+ * Releases an entry already erased from the registry. The exit
+ * hook looks entries up without the shard lock, so the memory is
+ * only freed after an RCU grace period.
+ */
+static void free_cput_entry(struct cput_entry *entry)
+{
+	/* Wait for a sampler that still saw the entry as alive */
+	write_seqlock(&entry->lock);
+	snap_free_slot(entry);
+	write_sequnlock(&entry->lock);
+	put_pid(entry->kpid);
+	call_rcu(&entry->rcu, free_cput_entry_rcu);
+}
+
+/* Reads the metrics of a task, all times in nsecs */
+static void read_task_stats(struct task_struct *task, 
+							struct usrt_stats *stats)
+{
+	u64 utime, stime;
+
+	task_cputime_adjusted(task, &utime, &stime);
+	stats->utime = utime;
+	stats->stime = stime;
+	stats->runtime = READ_ONCE(task->se.sum_exec_runtime);
+#ifdef CONFIG_SCHED_INFO
+	stats->wait = READ_ONCE(task->sched_info.run_delay);
+#else
+	stats->wait = 0;
+#endif
+	stats->nvcsw = READ_ONCE(task->nvcsw);
+	stats->nivcsw = READ_ONCE(task->nivcsw);
+	stats->min_flt = READ_ONCE(task->min_flt);
+	stats->maj_flt = READ_ONCE(task->maj_flt);
+}
 
 /* Helper function that help update the cputimes */
-int get_cpu_use(int pid, unsigned long *cpu_use)
+int get_cpu_use(struct pid *kpid, struct usrt_stats *stats)
 {
 	struct task_struct *task;
 
 	rcu_read_lock();
-	task = find_task_by_pid(pid);
+	task = pid_task(kpid, PIDTYPE_PID);
 	if (task != NULL) {
-		*cpu_use = task->utime;
+		read_task_stats(task, stats);
 		rcu_read_unlock();
 		return 0;
 	} else {
@@ -44,106 +506,1418 @@ int get_cpu_use(int pid, unsigned long *cpu_use)
 	}
 }
 
+static void ring_push(struct cput_ring *ring, u64 time, u64 cpu)
+{
+	ring->samples[ring->head].time = time;
+	ring->samples[ring->head].cpu = cpu;
+	ring->head = (ring->head + 1) % RING_SIZE;
+	if (ring->count < RING_SIZE)
+		ring->count++;
+}
+
+/* Returns the i-th newest sample, 0 being the newest one */
+static struct cput_sample *ring_get(struct cput_ring *ring, unsigned int i)
+{
+	return &ring->samples[(ring->head + RING_SIZE - 1 - i) % RING_SIZE];
+}
+
+/* CPU usage between two samples in hundredths of a percent */
+static u32 usage_bp(struct cput_sample *old, struct cput_sample *new)
+{
+	u64 dt = new->time - old->time;
+
+	if (dt == 0)
+		return 0;
+	return div64_u64((new->cpu - old->cpu) * 10000, dt);
+}
+
+/* 
+ * CPU usage over the newest samples spanning at most window_ns, 
+ * or over the last sampling period if it is longer than that.
+ */
+static u32 window_usage(struct cput_ring *ring, u64 window_ns)
+{
+	struct cput_sample *newest, *oldest;
+	unsigned int i;
+
+	if (ring->count < 2)
+		return 0;
+	newest = ring_get(ring, 0);
+	oldest = ring_get(ring, 1);
+	for (i = 2; i < ring->count; i++) {
+		if (newest->time - ring_get(ring, i)->time > window_ns)
+			break;
+		oldest = ring_get(ring, i);
+	}
+	return usage_bp(oldest, newest);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 
+ * Nearest-rank p50 and p99 of the CPU usage of the sampling
+ * periods in the ring.
+ */
+static void period_usage_pcts(struct cput_ring *ring, u32 *p50, u32 *p99)
+{
+	u32 usage[RING_SIZE - 1];
+	unsigned int i, n;
+
+	*p50 = *p99 = 0;
+	if (ring->count < 2)
+		return;
+	n = ring->count - 1;
+	for (i = 0; i < n; i++)
+		usage[i] = usage_bp(ring_get(ring, i + 1), ring_get(ring, i));
+	sort(usage, n, sizeof(u32), cmp_u32, NULL);
+	*p50 = usage[DIV_ROUND_UP(n * 50, 100) - 1];
+	*p99 = usage[DIV_ROUND_UP(n * 99, 100) - 1];
+}
+
+/* 
+ * Samples the CPU times of the process of entry and stores them
+ * in its ring and its snapshot record. Returns -1 if the process
+ * has exited.
+ */
+static int sample_entry(struct cput_entry *entry, u64 gen)
+{
+	int ret = -1;
+
+	write_seqlock(&entry->lock);
+	if (!test_bit(CPUT_EXITED, &entry->flags) &&
+		!get_cpu_use(entry->kpid, &entry->stats)) {
+		ring_push(entry->ring, ktime_get_ns(), entry->stats.runtime);
+		if (entry->slot >= 0)
+			snap_store(entry->slot, entry->pid,
+					   entry->stats.utime, entry->stats.stime, gen);
+		ret = 0;
+	}
+	write_sequnlock(&entry->lock);
+	return ret;
+}
+
+/* Starts the timer of a bucket that just got its first process */
+static void start_bucket(struct cput_bucket *b)
+{
+	if (lazy || READ_ONCE(stopping))
+		return;
+	hrtimer_start(&b->timer, ms_to_ktime(READ_ONCE(b->period_ms)),
+				  HRTIMER_MODE_REL);
+}
+
+/* 
+ * Takes a reference to the bucket that samples every period_ms,
+ * or to bucket 0 if period_ms is 0. Returns the bucket index, or
+ * -ENOSPC if all buckets are taken by other periods.
+ */
+static int get_bucket(unsigned int period_ms)
+{
+	int i, free;
+
+	if (period_ms == 0) {
+		if (atomic_inc_return(&buckets[0].users) == 1)
+			start_bucket(&buckets[0]);
+		return 0;
+	}
+	free = -ENOSPC;
+	mutex_lock(&bucket_lock);
+	for (i = 1; i < MAX_BUCKETS; i++) {
+		if (!atomic_read(&buckets[i].users)) {
+			if (free < 0)
+				free = i;
+		} else if (buckets[i].period_ms == period_ms) {
+			break;
+		}
+	}
+	if (i == MAX_BUCKETS) {
+		if (free < 0) {
+			mutex_unlock(&bucket_lock);
+			return free;
+		}
+		i = free;
+		WRITE_ONCE(buckets[i].period_ms, period_ms);
+	}
+	if (atomic_inc_return(&buckets[i].users) == 1)
+		start_bucket(&buckets[i]);
+	mutex_unlock(&bucket_lock);
+	return i;
+}
+
+/* 
+ * Drops the reference of an entry to its bucket. The timer of a 
+ * bucket left without processes stops at its next expiry.
+ */
+static void put_bucket(unsigned int i)
+{
+	atomic_dec(&buckets[i].users);
+}
+
+/* 
+ * Wakes up the pollers of usrt/status. Called from the timer 
+ * handler as well, so it must not sleep.
+ */
+static void status_changed(void)
+{
+	atomic64_inc(&status_event);
+	if (wq_has_sleeper(&status_wait))
+		wake_up_interruptible_poll(&status_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* 
+ * Gives the entry the sequence number seq, when it is registered and
+ * when a sample finds that its process has run. The index by sequence
+ * number lets a delta read find the entries changed since a given
+ * sequence number without walking the others. Needs the shard lock.
+ */
+static void entry_changed(struct cput_shard *shard, struct cput_entry *entry,
+						  u64 seq)
+{
+	if (entry->change_seq == seq)
+		return;
+	if (xa_err(xa_store(&shard->by_seq, seq_index(seq, entry->pid), entry,
+						GFP_KERNEL))) {
+		printk(KERN_ALERT "error: xa_store failed\n");
+		return;
+	}
+	if (entry->change_seq)
+		xa_erase(&shard->by_seq, seq_index(entry->change_seq, entry->pid));
+	entry->change_seq = seq;
+}
+
+/* Drops the older half of the removal markers of a shard */
+static void prune_gone(struct cput_shard *shard)
+{
+	unsigned long index;
+	s64 floor, old;
+	void *v;
+
+	floor = 0;
+	xa_for_each(&shard->by_seq, index, v) {
+		if (shard->nr_gone <= GONE_MAX / 2)
+			break;
+		if (!xa_is_value(v))
+			continue;
+		xa_erase(&shard->by_seq, index);
+		xa_erase(&shard->gone, xa_to_value(v));
+		shard->nr_gone--;
+		floor = index >> SEQ_PID_BITS;
+	}
+	old = atomic64_read(&gone_floor);
+	while (old < floor && !atomic64_try_cmpxchg(&gone_floor, &old, floor))
+		;
+}
+
+/* 
+ * Replaces the index entry of a removed entry with a marker of its 
+ * pid, as a change of the next pass. Needs the shard lock.
+ */
+static void mark_gone(struct cput_shard *shard, struct cput_entry *entry)
+{
+	u64 seq = atomic64_read(&pass_seq) + 1;
+	unsigned long index = seq_index(seq, entry->pid);
+
+	/* Delta reads, and thus markers, are not used in the lazy mode */
+	if (!lazy &&
+		!xa_err(xa_store(&shard->by_seq, index, xa_mk_value(entry->pid),
+						 GFP_KERNEL))) {
+		if (xa_err(xa_store(&shard->gone, entry->pid, xa_mk_value(seq),
+							GFP_KERNEL)))
+			xa_erase(&shard->by_seq, index);
+		else if (++shard->nr_gone > GONE_MAX)
+			prune_gone(shard);
+	}
+	if (entry->change_seq && entry->change_seq != seq)
+		xa_erase(&shard->by_seq, seq_index(entry->change_seq, entry->pid));
+}
+
+/* 
+ * Removes an entry from the registry and releases it.
+ * Needs the shard lock.
+ */
+static void remove_cput_entry(struct cput_shard *shard,
+							  struct cput_entry *entry)
+{
+	xa_erase(&shard->xa, entry->pid);
+	mark_gone(shard, entry);
+	list_del(&entry->bucket_node);
+	put_bucket(entry->bucket);
+	atomic_dec(&nr_cput);
+	free_cput_entry(entry);
+	status_changed();
+}
+
+/* 
+ * Publishes a completed sampling pass in the snapshot header. 
+ * Passes of different buckets may complete out of order, and the
+ * header keeps the latest one.
+ */
+static void publish_pass(u64 gen)
+{
+	u64 old, prev;
+
+	/* Announce the pass only after all of its records are stored */
+	smp_wmb();
+	old = READ_ONCE(snap_hdr->gen);
+	while (old < gen) {
+		prev = cmpxchg64(&snap_hdr->gen, old, gen);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+	status_changed();
+}
+
+static struct genl_family usrt_genl;
+
+enum {
+	USRT_MCGRP_SAMPLES_ID,
+};
+
+static bool nl_listening(void)
+{
+	return genl_has_listeners(&usrt_genl, &init_net, USRT_MCGRP_SAMPLES_ID);
+}
+
+/* Queues a changed sample for the multicast that ends the pass */
+static void stage_sample(struct cput_staged *st, struct cput_entry *entry)
+{
+	struct usrt_nl_sample *samples;
+	unsigned int cap;
+
+	if (st->len == st->cap) {
+		cap = max(2 * st->cap, 64U);
+		samples = krealloc_array(st->samples, cap,
+								 sizeof(struct usrt_nl_sample), GFP_KERNEL);
+		/* The sample is still in the status file and the snapshot */
+		if (samples == NULL)
+			return;
+		st->samples = samples;
+		st->cap = cap;
+	}
+	st->samples[st->len].pid = entry->pid;
+	st->samples[st->len].flags = 0;
+	st->samples[st->len].stats = entry->stats;
+	st->len++;
+}
+
+static struct sk_buff *nl_new_samples(u64 gen, void **hdr)
+{
+	struct sk_buff *skb;
+
+	skb = genlmsg_new(nla_total_size_64bit(sizeof(u64)) +
+					  nla_total_size(USRT_NL_BATCH *
+									 sizeof(struct usrt_nl_sample)) +
+					  nla_total_size(0), GFP_KERNEL);
+	if (skb == NULL)
+		return NULL;
+	*hdr = genlmsg_put(skb, 0, 0, &usrt_genl, 0, USRT_CMD_SAMPLES);
+	if (*hdr == NULL ||
+		nla_put_u64_64bit(skb, USRT_ATTR_GEN, gen, USRT_ATTR_PAD)) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+static void nl_send_samples(struct sk_buff *skb, void *hdr,
+							struct usrt_nl_sample *samples,
+							unsigned int n, bool last)
+{
+	if (nla_put(skb, USRT_ATTR_SAMPLES,
+				n * sizeof(struct usrt_nl_sample), samples) ||
+		(last && nla_put_flag(skb, USRT_ATTR_LAST))) {
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&usrt_genl, skb, 0, USRT_MCGRP_SAMPLES_ID, GFP_KERNEL);
+}
+
+/* Multicasts samples in as few messages as USRT_NL_BATCH allows */
+static void nl_multicast_samples(u64 gen, struct usrt_nl_sample *samples,
+								 unsigned int n)
+{
+	struct sk_buff *skb;
+	unsigned int i;
+	void *hdr;
+
+	for (i = 0; i < n; i += USRT_NL_BATCH) {
+		skb = nl_new_samples(gen, &hdr);
+		if (skb == NULL)
+			break;
+		nl_send_samples(skb, hdr, samples + i, 
+						min_t(unsigned int, n - i, USRT_NL_BATCH),
+						i + USRT_NL_BATCH >= n);
+	}
+}
+
+/* 
+ * Multicasts the samples that changed during the pass of a bucket,
+ * in as few messages as USRT_NL_BATCH allows. The samples staged
+ * by the shards are gathered into one buffer first, so that only
+ * the last message of the pass needs to know that it is the last.
+ */
+static void publish_samples(unsigned int bucket, u64 gen)
+{
+	struct usrt_nl_sample *all;
+	struct cput_staged *st;
+	unsigned int i, total, n;
+	u64 locked;
+
+	total = 0;
+	for (i = 0; i < nr_shards; i++)
+		total += READ_ONCE(shards[i].staged[bucket].len);
+	if (total == 0)
+		return;
+	all = kvmalloc_array(total, sizeof(struct usrt_nl_sample), GFP_KERNEL);
+	n = 0;
+	for (i = 0; i < nr_shards; i++) {
+		st = &shards[i].staged[bucket];
+		locked = lock_shard(&shards[i]);
+		/* 
+		 * Samples staged since the count above are left for the
+		 * next pass of the bucket.
+		 */
+		if (all == NULL) {
+			st->len = 0;
+		} else if (n + st->len <= total) {
+			memcpy(all + n, st->samples,
+				   st->len * sizeof(struct usrt_nl_sample));
+			n += st->len;
+			st->len = 0;
+		}
+		unlock_shard(&shards[i], locked);
+	}
+	if (all == NULL) {
+		printk(KERN_ALERT "error: kvmalloc_array: no memory available\n");
+		return;
+	}
+	if (nl_listening())
+		nl_multicast_samples(gen, all, n);
+	kvfree(all);
+}
+
+/* The published top processes, heaviest first */
+static struct cput_top *top_rows;
+static struct cput_top *top_merge;
+static unsigned int nr_top;
+/* Serializes merging the top arrays and reading usrt/top */
+static DEFINE_MUTEX(top_lock);
+
+static int cmp_top(const void *a, const void *b)
+{
+	const struct cput_top *x = a, *y = b;
+
+	return x->usage > y->usage ? -1 : x->usage < y->usage;
+}
+
+/* Sorts the rows, heaviest first, and keeps at most topk of them */
+static void top_trim(struct cput_topk *t)
+{
+	sort(t->rows, t->nr, sizeof(struct cput_top), cmp_top, NULL);
+	if (t->nr < topk)
+		return;
+	t->nr = topk;
+	t->full = true;
+	t->floor = t->rows[topk - 1].usage;
+}
+
+/* 
+ * Adds a process unless topk heavier ones are known already. As the
+ * array is trimmed only once per topk additions, a process costs
+ * O(log topk) on average.
+ */
+static void top_add(struct cput_topk *t, const struct cput_top *row)
+{
+	if (t->full && row->usage <= t->floor)
+		return;
+	t->rows[t->nr++] = *row;
+	if (t->nr == 2 * topk)
+		top_trim(t);
+}
+
+/* Ranks a process just sampled in the array of its shard and bucket */
+static void top_sample(struct cput_topk *t, struct cput_entry *entry)
+{
+	struct cput_sample *newest, *prev;
+	struct cput_top row;
+
+	if (entry->ring->count < 2)
+		return;
+	newest = ring_get(entry->ring, 0);
+	prev = ring_get(entry->ring, 1);
+	row.pid = entry->pid;
+	row.usage = usage_bp(prev, newest);
+	row.delta = newest->cpu - prev->cpu;
+	top_add(t, &row);
+}
+
+/* 
+ * Merges the arrays of the last completed pass of every bucket into
+ * usrt/top. Arrays of an older pass belong to shards that have no 
+ * processes of the bucket left, and are skipped.
+ */
+static void publish_top(void)
+{
+	struct cput_topk merge = { .rows = top_merge };
+	struct cput_top *rows;
+	struct cput_shard *shard;
+	unsigned int i, j, k;
+	u64 locked;
+
+	mutex_lock(&top_lock);
+	for (i = 0; i < nr_shards; i++) {
+		shard = &shards[i];
+		locked = lock_shard(shard);
+		for (j = 0; j < MAX_BUCKETS; j++) {
+			if (shard->top_gen[j] < READ_ONCE(buckets[j].done_gen))
+				continue;
+			rows = shard->top[j].rows;
+			for (k = 0; k < shard->top[j].nr; k++)
+				top_add(&merge, &rows[k]);
+		}
+		unlock_shard(shard, locked);
+	}
+	top_trim(&merge);
+	swap(top_rows, top_merge);
+	nr_top = merge.nr;
+	mutex_unlock(&top_lock);
+}
+
+/* 
+ * Throttles a process that ran over its budget, with budget_signal
+ * or by running it as SCHED_IDLE. A SCHED_DEADLINE task cannot be
+ * made SCHED_IDLE, so it is only throttled by a signal.
+ */
+static void throttle_entry(struct cput_entry *entry)
+{
+	struct sched_attr attr = { .size = sizeof(attr) };
+	struct task_struct *task;
+	int sig = READ_ONCE(budget_signal);
+
+	if (sig) {
+		if (!valid_signal(sig) || kill_pid(entry->kpid, sig, 1))
+			return;
+		entry->throttle = sig;
+		return;
+	}
+	task = get_pid_task(entry->kpid, PIDTYPE_PID);
+	if (task == NULL)
+		return;
+	if (task->policy != SCHED_DEADLINE && task->policy != SCHED_IDLE) {
+		entry->saved_policy = task->policy;
+		entry->saved_nice = task_nice(task);
+		entry->saved_rt_prio = task->rt_priority;
+		attr.sched_policy = SCHED_IDLE;
+		if (!sched_setattr_nocheck(task, &attr))
+			entry->throttle = -1;
+	}
+	put_task_struct(task);
+}
+
+/* Lets a throttled process run as before */
+static void release_entry(struct cput_entry *entry)
+{
+	struct sched_attr attr = { .size = sizeof(attr) };
+	struct task_struct *task;
+
+	if (entry->throttle == SIGSTOP) {
+		kill_pid(entry->kpid, SIGCONT, 1);
+	} else if (entry->throttle < 0) {
+		task = get_pid_task(entry->kpid, PIDTYPE_PID);
+		if (task) {
+			attr.sched_policy = entry->saved_policy;
+			attr.sched_nice = entry->saved_nice;
+			attr.sched_priority = entry->saved_rt_prio;
+			sched_setattr_nocheck(task, &attr);
+			put_task_struct(task);
+		}
+	}
+	entry->throttle = 0;
+}
+
+/* 
+ * Checks the runtime of a process with a budget against it, right
+ * after the process was sampled, and starts a new window once the 
+ * current one is over. A process is throttled at most once per
+ * window. Needs the shard lock.
+ */
+static void enforce_budget(struct cput_entry *entry)
+{
+	u64 now;
+
+	if (!entry->budget_ns)
+		return;
+	now = ktime_get_ns();
+	if (now - entry->window_start >= entry->window_ns) {
+		if (entry->throttle)
+			release_entry(entry);
+		entry->window_start = now;
+		entry->window_base = entry->stats.runtime;
+	} else if (!entry->throttle &&
+			   entry->stats.runtime - entry->window_base > entry->budget_ns) {
+		throttle_entry(entry);
+	}
+}
+
+/* 
+ * Work function, run for each shard in parallel
+ * (Botton-Half of the Two-Halves interrupt handler design) 
+ */
+static void update_cputimes(struct work_struct *work)
+{
+	struct cput_work *cw;
+	struct cput_shard *shard;
+	struct cput_bucket *b;
+	struct cput_entry *entry, *temp;
+	bool listening;
+	u64 runtime, start, locked, gen, expires;
+
+	cw = container_of(work, struct cput_work, work);
+	shard = cw->shard;
+	b = &buckets[cw->bucket];
+	/* 
+	 * Once this shard leaves the pass, the timer may start the
+	 * next one, so the pass is read while this one holds it.
+	 */
+	gen = b->gen;
+	expires = b->expires_ns;
+	start = ktime_get_ns();
+	dbg_hist(DBG_LATENESS, start - expires);
+	listening = nl_listening();
+	locked = lock_shard(shard);
+	shard->top[cw->bucket].nr = 0;
+	shard->top[cw->bucket].full = false;
+	shard->top_gen[cw->bucket] = gen;
+	list_for_each_entry_safe(entry, temp, &shard->lists[cw->bucket],
+							 bucket_node) {
+		runtime = entry->stats.runtime;
+		/* 
+		 * Normally the exit hook already took care of exited 
+		 * processes, so this only catches the ones it missed.
+		 */
+		dbg_count(DBG_SAMPLES);
+		if (sample_entry(entry, gen)) {
+			if (!test_and_set_bit(CPUT_EXITED, &entry->flags))
+				remove_cput_entry(shard, entry);
+		} else {
+			enforce_budget(entry);
+			if (topk)
+				top_sample(&shard->top[cw->bucket], entry);
+			if (entry->stats.runtime != runtime) {
+				entry_changed(shard, entry, gen);
+				if (listening)
+					stage_sample(&shard->staged[cw->bucket], entry);
+			}
+		}
+	}
+	unlock_shard(shard, locked);
+	dbg_hist(DBG_WORK, ktime_get_ns() - start);
+	/* The last shard to finish completes the pass */
+	if (atomic_dec_and_test(&b->pending)) {
+		publish_pass(gen);
+		dbg_hist(DBG_PASS, ktime_get_ns() - expires);
+		WRITE_ONCE(b->done_gen, gen);
+		if (topk)
+			publish_top();
+		publish_samples(cw->bucket, gen);
+	}
+}
+
+static void entry_exit(struct task_struct *task)
+{
+	struct cput_entry *entry;
+
+	entry = xa_load(&pid_shard(task_pid_nr(task))->xa, task_pid_nr(task));
+	if (entry && entry->kpid == task_pid(task) &&
+		!test_and_set_bit(CPUT_EXITED, &entry->flags)) {
+		read_task_stats(task, &entry->exit_stats);
+		llist_add(&entry->exit_node, &exit_list);
+		queue_work(workqueue, &exit_work);
+	}
+}
+
+static void group_exit(struct task_struct *task)
+{
+	struct cput_group *grp;
+
+	/* Only the last thread to exit takes the thread group down */
+	if (atomic_read(&task->signal->live))
+		return;
+	grp = xa_load(&tg_xa, task_tgid_nr(task));
+	if (grp && grp->kpid == task_tgid(task) &&
+		!test_and_set_bit(CPUT_EXITED, &grp->flags)) {
+		llist_add(&grp->exit_node, &group_exit_list);
+		queue_work(workqueue, &exit_work);
+	}
+}
+
+/* 
+ * Probe of the sched_process_exit tracepoint. It runs for every
+ * exiting task in the system and cannot sleep, so it only records
+ * the final CPU times of a registered process and leaves removing
+ * the entry, or the thread group, to reap_exited().
+ */
+static void probe_process_exit(void *data, struct task_struct *task)
+{
+	rcu_read_lock();
+	if (atomic_read(&nr_cput))
+		entry_exit(task);
+	if (atomic_read(&nr_tgs))
+		group_exit(task);
+	rcu_read_unlock();
+}
+
+/* 
+ * Probe of the sched_stat_runtime tracepoint, which the scheduler
+ * hits whenever it accounts runtime to a task. It runs with
+ * preemption disabled, so adding to the counter of this CPU needs
+ * no lock.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+static void probe_stat_runtime(void *data, struct task_struct *task,
+							   u64 runtime)
+#else
+static void probe_stat_runtime(void *data, struct task_struct *task,
+							   u64 runtime, u64 vruntime)
+#endif
+{
+	struct cput_group *grp;
+#ifdef CONFIG_CGROUPS
+	struct cgroup *cgrp;
+#endif
+
+	rcu_read_lock();
+	if (atomic_read(&nr_tgs)) {
+		grp = xa_load(&tg_xa, task_tgid_nr(task));
+		if (grp && grp->kpid == task_tgid(task))
+			this_cpu_add(*grp->runtime, runtime);
+	}
+#ifdef CONFIG_CGROUPS
+	/* A task counts toward every registered ancestor cgroup */
+	if (atomic_read(&nr_cgs))
+		for (cgrp = task_dfl_cgroup(task); cgrp; cgrp = cgroup_parent(cgrp)) {
+			grp = xa_load(&cg_xa, cgroup_id(cgrp));
+			if (grp)
+				this_cpu_add(*grp->runtime, runtime);
+		}
+#endif
+	rcu_read_unlock();
+}
+
+static void free_group_rcu(struct rcu_head *rcu)
+{
+	struct cput_group *grp = container_of(rcu, struct cput_group, rcu);
+
+	free_percpu(grp->runtime);
+	kfree(grp->path);
+	kfree(grp);
+}
+
+/* 
+ * Releases a group already erased from its index. The probes only
+ * compare the references the group holds, so they are dropped right
+ * away, but the memory is freed after an RCU grace period.
+ */
+static void free_group(struct cput_group *grp)
+{
+	if (grp->kpid)
+		put_pid(grp->kpid);
+#ifdef CONFIG_CGROUPS
+	if (grp->cgrp)
+		cgroup_put(grp->cgrp);
+#endif
+	call_rcu(&grp->rcu, free_group_rcu);
+}
+
+/* 
+ * Work function that finalizes and removes exited processes. The 
+ * CPU times recorded at exit are the final sample of a process, and
+ * are multicast to the netlink subscribers before it is removed.
+ */
+static void reap_exited(struct work_struct *work)
+{
+	struct cput_entry *entry, *temp;
+	struct cput_group *grp, *gtemp;
+	struct usrt_nl_sample *samples = NULL;
+	struct llist_node *exited, *node;
+	struct cput_shard *shard;
+	unsigned int n = 0;
+	u64 locked;
+
+	exited = llist_del_all(&exit_list);
+	if (exited && nl_listening()) {
+		llist_for_each(node, exited)
+			n++;
+		samples = kvmalloc_array(n, sizeof(struct usrt_nl_sample),
+								 GFP_KERNEL);
+		n = 0;
+	}
+	llist_for_each_entry_safe(entry, temp, exited, exit_node) {
+		shard = pid_shard(entry->pid);
+		locked = lock_shard(shard);
+		dbg_count(DBG_EXITS);
+		write_seqlock(&entry->lock);
+		entry->stats = entry->exit_stats;
+		write_sequnlock(&entry->lock);
+		if (samples) {
+			samples[n].pid = entry->pid;
+			samples[n].flags = USRT_SAMPLE_EXITED;
+			samples[n].stats = entry->stats;
+			n++;
+		}
+
+		#ifdef DEBUG
+		printk(KERN_INFO "USRT %u EXITED: %llu, %llu\n",
+			   entry->pid, entry->stats.utime, entry->stats.stime);
+		#endif
+
+		remove_cput_entry(shard, entry);
+		unlock_shard(shard, locked);
+	}
+	if (samples) {
+		nl_multicast_samples(READ_ONCE(snap_hdr->gen), samples, n);
+		kvfree(samples);
+	}
+	exited = llist_del_all(&group_exit_list);
+	llist_for_each_entry_safe(grp, gtemp, exited, exit_node) {
+		mutex_lock(&group_lock);
+		xa_erase(&tg_xa, grp->id);
+		atomic_dec(&nr_tgs);
+		mutex_unlock(&group_lock);
+		free_group(grp);
+	}
+}
+
+static void find_tps(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sched_process_exit"))
+		exit_tp = tp;
+	else if (!strcmp(tp->name, "sched_stat_runtime"))
+		runtime_tp = tp;
+}
+
+/* 
+ * Timer interrupt handler of a bucket
+ * (the Top-Half of the Two-Halves interrupt handler design) 
+ */
+static enum hrtimer_restart schedule_cput_upds(struct hrtimer *timer)
+{
+	struct cput_bucket *b;
+	unsigned int i, id;
+
+	b = container_of(timer, struct cput_bucket, timer);
+	id = b - buckets;
+	/* 
+	 * Stop the timer if the bucket has no processes left.
+	 * The next process to join the bucket starts it again.
+	 */
+	if (READ_ONCE(stopping) || !atomic_read(&b->users))
+		return HRTIMER_NORESTART;
+	/* 
+	 * Skip the period if the previous pass is still running. 
+	 * Otherwise schedule update_cputimes(), the work function w/ 
+	 * the workqueue, for the shards that have processes in this
+	 * bucket. The workqueue is unbound, so the shards are sampled
+	 * concurrently on any idle CPUs. pending holds one extra count
+	 * until all the work is queued.
+	 */
+	if (!atomic_cmpxchg(&b->pending, 0, 1)) {
+		dbg_count(DBG_PASSES);
+		b->gen = atomic64_inc_return(&pass_seq);
+		b->expires_ns = ktime_to_ns(hrtimer_get_expires(timer));
+		for (i = 0; i < nr_shards; i++) {
+			if (list_empty(&shards[i].lists[id]))
+				continue;
+			atomic_inc(&b->pending);
+			if (!queue_work(workqueue, &shards[i].works[id].work)) {
+				printk(KERN_ALERT "error: queue_work failed\n");
+				atomic_dec(&b->pending);
+			}
+		}
+		if (atomic_dec_and_test(&b->pending))
+			publish_pass(b->gen);
+	} else {
+		dbg_count(DBG_OVERRUNS);
+	}
+	hrtimer_forward_now(timer, ms_to_ktime(READ_ONCE(b->period_ms)));
+	return HRTIMER_RESTART;
+}
+
+static int set_interval(const char *val, const struct kernel_param *kp)
+{
+	unsigned int ms;
+	int ret;
+
+	if ((ret = kstrtouint(val, 10, &ms)))
+		return ret;
+	if (ms == 0)
+		return -EINVAL;
+	WRITE_ONCE(interval, ms);
+	WRITE_ONCE(buckets[0].period_ms, ms);
+	/* Apply the new period now rather than at the next expiry */
+	if (!lazy && !READ_ONCE(stopping) && atomic_read(&buckets[0].users))
+		hrtimer_start(&buckets[0].timer, ms_to_ktime(ms), 
+					  HRTIMER_MODE_REL);
+	return 0;
+}
+
+/* 
+ * The status file is streamed with the seq_file interface.
+ * The position is the shard (upper 32 bits) and the pid (lower
+ * 32 bits) of the next entry to print, so a read() call resumes
+ * right where the previous one stopped without walking the entries
+ * already printed. The registry is walked under RCU, so a reader,
+ * however slow, never holds up the sampling or the registrations.
+ *
+ * After "since <seq>" is written to an open file, its reads are
+ * delta reads: they start with a "seq: <seq>" line and list only
+ * the entries changed after the given sequence number, found through
+ * the by_seq index of each shard, and a "-<pid>" line for each pid
+ * removed since then. The shard and sequence number of
+ * the next entry to print are then kept in the iterator, as they do
+ * not fit in the position.
+ */
+struct usr_iter {
+	/* Value of status_event when the file was last read */
+	u64 event;
+	bool delta;
+	u64 since;
+	/* Sequence number at the start of the current delta read */
+	u64 head;
+	unsigned int shard;
+	unsigned long cursor;
+};
+
+/* 
+ * Returns the sequence number up to which the changes are all in
+ * the index, i.e. the latest pass not preceded by one that is still
+ * running. Passes are numbered before they are marked pending, so
+ * the passes are read before the buckets.
+ */
+static u64 usr_delta_head(void)
+{
+	u64 head, gen;
+	unsigned int i;
+
+	head = atomic64_read(&pass_seq);
+	smp_rmb();
+	for (i = 0; i < MAX_BUCKETS; i++) {
+		if (!atomic_read(&buckets[i].pending))
+			continue;
+		gen = READ_ONCE(buckets[i].gen);
+		head = min(head, gen ? gen - 1 : 0);
+	}
+	/* Pairs with the barrier of the last shard leaving a pass */
+	smp_rmb();
+	return head;
+}
+
+static void *usr_delta_find(struct usr_iter *it)
+{
+	struct cput_entry *entry;
+
+	for (; it->shard < nr_shards;
+		 it->shard++, it->cursor = seq_index(it->since + 1, 0)) {
+		entry = xa_find(&shards[it->shard].by_seq, &it->cursor,
+						ULONG_MAX, XA_PRESENT);
+		if (entry)
+			return entry;
+	}
+	return NULL;
+}
+
+static void *usr_seq_find(loff_t *pos)
+{
+	struct cput_entry *entry;
+	unsigned long index;
+	unsigned int i;
+
+	index = *pos & U32_MAX;
+	for (i = *pos >> 32; i < nr_shards; i++, index = 0) {
+		entry = xa_find(&shards[i].xa, &index, ULONG_MAX, XA_PRESENT);
+		if (entry) {
+			*pos = ((loff_t)i << 32) | index;
+			return entry;
+		}
+	}
+	*pos = (loff_t)nr_shards << 32;
+	return NULL;
+}
+
+static void *usr_seq_start(struct seq_file *m, loff_t *pos)
+	__acquires(RCU)
+{
+	struct usr_iter *it = m->private;
+
+	rcu_read_lock();
+	/* A read from the start consumes the events reported by poll() */
+	if (*pos == 0)
+		WRITE_ONCE(it->event, atomic64_read(&status_event));
+	if (!it->delta)
+		return usr_seq_find(pos);
+	if (*pos == 0) {
+		/* Removals after since may have been dropped already */
+		if (it->since && it->since < atomic64_read(&gone_floor))
+			return ERR_PTR(-ESTALE);
+		it->head = usr_delta_head();
+		it->shard = 0;
+		it->cursor = seq_index(it->since + 1, 0);
+		return SEQ_START_TOKEN;
+	}
+	return usr_delta_find(it);
+}
+
+static void *usr_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct usr_iter *it = m->private;
+
+	++*pos;
+	if (!it->delta)
+		return usr_seq_find(pos);
+	if (v != SEQ_START_TOKEN)
+		it->cursor++;
+	return usr_delta_find(it);
+}
+
+static void usr_seq_stop(struct seq_file *m, void *v)
+	__releases(RCU)
+{
+	rcu_read_unlock();
+
+	#ifdef DEBUG
+	printk(KERN_INFO "USER READ\n");
+	#endif
+}
+
+static int usr_seq_show(struct seq_file *m, void *v)
+{
+	struct cput_entry *entry = v;
+	struct usr_iter *it = m->private;
+	struct usrt_stats stats;
+	u32 usage[5];
+	unsigned int seq;
+	int i;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "seq: %llu\n", it->head);
+		return 0;
+	}
+	/* Removal marker of a delta read */
+	if (xa_is_value(v)) {
+		seq_printf(m, "-%lu\n", xa_to_value(v));
+		return 0;
+	}
+	/* In the lazy mode the entry is sampled here */
+	if (lazy)
+		sample_entry(entry, READ_ONCE(snap_hdr->gen));
+	do {
+		seq = read_seqbegin(&entry->lock);
+		stats = entry->stats;
+		usage[0] = window_usage(entry->ring, 1 * NSEC_PER_SEC);
+		usage[1] = window_usage(entry->ring, 10 * NSEC_PER_SEC);
+		usage[2] = window_usage(entry->ring, 60 * NSEC_PER_SEC);
+		period_usage_pcts(entry->ring, &usage[3], &usage[4]);
+	} while (read_seqretry(&entry->lock, seq));
+	seq_printf(m, "%u: %llu %llu %llu %llu %llu %llu %llu %llu", 
+		entry->pid, stats.utime, stats.stime, stats.runtime, stats.wait,
+		stats.nvcsw, stats.nivcsw, stats.min_flt, stats.maj_flt);
+	for (i = 0; i < ARRAY_SIZE(usage); i++)
+		seq_printf(m, " %u.%02u", usage[i] / 100, usage[i] % 100);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations usr_seq_ops = {
+	.start = usr_seq_start,
+	.next = usr_seq_next,
+	.stop = usr_seq_stop,
+	.show = usr_seq_show,
+};
+
+static int usr_open(struct inode *inode, struct file *file)
+{
+	struct usr_iter *it;
+
+	it = seq_open_private(file, &usr_seq_ops, sizeof(struct usr_iter));
+	if (it == NULL)
+		return -ENOMEM;
+	it->event = atomic64_read(&status_event);
+	return 0;
+}
+
+/* 
+ * The status file polls readable after a completed sampling pass or
+ * registry change, until it is read again from the start. Polling 
+ * itself must not consume the event, as epoll calls ->poll() on its
+ * own, e.g. when the file is added, and the event would be lost.
+ */
+static __poll_t usr_poll(struct file *file, poll_table *wait)
+{
+	struct seq_file *m = file->private_data;
+	struct usr_iter *it = m->private;
+
+	poll_wait(file, &status_wait, wait);
+	if (atomic64_read(&status_event) == READ_ONCE(it->event))
+		return 0;
+	return EPOLLIN | EPOLLRDNORM;
+}
+
+/* 
+ * Only a caller that may signal and renice the process itself can 
+ * give it a budget, as throttling it bypasses those checks.
+ */
+static bool may_throttle(struct pid *kpid)
+{
+	struct task_struct *task;
+	bool ret;
+
+	if (capable(CAP_KILL) && capable(CAP_SYS_NICE))
+		return true;
+	task = get_pid_task(kpid, PIDTYPE_PID);
+	if (task == NULL)
+		return false;
+	ret = ptrace_may_access(task, PTRACE_MODE_ATTACH_REALCREDS);
+	put_task_struct(task);
+	return ret;
+}
+
+/* 
+ * Sets up a freshly allocated entry for the process of ent, sampled
+ * every period_ms msecs or every interval msecs if period_ms is 0,
+ * and limited to budget_ms msecs of CPU time every window_ms msecs
+ * if budget_ms is not 0.
+ */
+static int init_cput_entry(struct cput_entry *cput,
+						   const struct usrt_batch_ent *ent)
+{
+	unsigned int period_ms = ent->period_ms;
+	struct pid *kpid;
+	int bucket;
+
+	if (ent->pid <= 0 || (ent->budget_ms && !ent->window_ms))
+		return -EINVAL;
+	/* Budgets are checked by the sampling passes, which lazy lacks */
+	if (ent->budget_ms && lazy)
+		return -EOPNOTSUPP;
+	kpid = find_get_pid(ent->pid);
+	if (kpid == NULL)
+		return -ESRCH;
+	if (ent->budget_ms && !may_throttle(kpid)) {
+		put_pid(kpid);
+		return -EPERM;
+	}
+	bucket = get_bucket(period_ms);
+	if (bucket < 0) {
+		printk(KERN_ALERT "error: no sampling bucket left for %u msecs\n",
+			   period_ms);
+		put_pid(kpid);
+		return bucket;
+	}
+	cput->ring->head = 0;
+	cput->ring->count = 0;
+	cput->bucket = bucket;
+	cput->pid = pid_nr(kpid);
+	cput->kpid = kpid;
+	memset(&cput->stats, 0, sizeof(cput->stats));
+	cput->flags = 0;
+	cput->change_seq = 0;
+	cput->budget_ns = (u64)ent->budget_ms * NSEC_PER_MSEC;
+	cput->window_ns = (u64)ent->window_ms * NSEC_PER_MSEC;
+	/* The first sample starts the first window */
+	cput->window_start = 0;
+	cput->throttle = 0;
+	seqlock_init(&cput->lock);
+	return 0;
+}
+
+/* 
+ * Adds an initialized entry to the registry, or releases it if that
+ * fails. Returns -EBUSY if the pid is already registered. Needs the
+ * shard lock.
+ */
+static int insert_cput_entry(struct cput_shard *shard,
+							 struct cput_entry *cput)
+{
+	void *old;
+	int ret;
+
+	ret = xa_insert(&shard->xa, cput->pid, cput, GFP_KERNEL);
+	if (ret) {
+		put_bucket(cput->bucket);
+		put_pid(cput->kpid);
+		kmem_cache_free(cput_ring_cache, cput->ring);
+		kmem_cache_free(cput_entry_cache, cput);
+		if (ret != -EBUSY)
+			printk(KERN_ALERT "error: xa_insert failed\n");
+		return ret;
+	}
+	list_add_tail(&cput->bucket_node, &shard->lists[cput->bucket]);
+	/* The pid is back, which supersedes its removal */
+	old = xa_erase(&shard->gone, cput->pid);
+	if (old) {
+		xa_erase(&shard->by_seq, seq_index(xa_to_value(old), cput->pid));
+		shard->nr_gone--;
+	}
+	snap_alloc_slot(cput);
+	/* Registrations count as changes of the next pass */
+	entry_changed(shard, cput, atomic64_read(&pass_seq) + 1);
+	atomic_inc(&nr_cput);
+	return 0;
+}
+
+/* 
+ * Registers up to REG_CHUNK processes. The entries and their rings
+ * are allocated in bulk, and each shard is locked once for all the
+ * processes of the chunk that fall into it. Returns the number of
+ * processes added.
+ */
+static unsigned int register_chunk(struct usrt_batch_ent *ents,
+								   unsigned int n)
+{
+	struct cput_entry *cputs[REG_CHUNK];
+	void *rings[REG_CHUNK];
+	struct cput_shard *shard;
+	unsigned int i, j, added;
+	u64 locked;
+	int ret;
+
+	if (!kmem_cache_alloc_bulk(cput_entry_cache, GFP_KERNEL, n,
+							   (void **)cputs)) {
+		printk(KERN_ALERT "error: kmem_cache_alloc_bulk: no memory available\n");
+		for (i = 0; i < n; i++)
+			ents[i].status = -ENOMEM;
+		return 0;
+	}
+	if (!kmem_cache_alloc_bulk(cput_ring_cache, GFP_KERNEL, n, rings)) {
+		printk(KERN_ALERT "error: kmem_cache_alloc_bulk: no memory available\n");
+		kmem_cache_free_bulk(cput_entry_cache, n, (void **)cputs);
+		for (i = 0; i < n; i++)
+			ents[i].status = -ENOMEM;
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		cputs[i]->ring = rings[i];
+		ents[i].status = init_cput_entry(cputs[i], &ents[i]);
+		if (ents[i].status) {
+			kmem_cache_free(cput_ring_cache, rings[i]);
+			kmem_cache_free(cput_entry_cache, cputs[i]);
+			cputs[i] = NULL;
+		}
+	}
+	added = 0;
+	for (i = 0; i < n; i++) {
+		if (cputs[i] == NULL)
+			continue;
+		shard = pid_shard(cputs[i]->pid);
+		locked = lock_shard(shard);
+		for (j = i; j < n; j++) {
+			if (cputs[j] == NULL || pid_shard(cputs[j]->pid) != shard)
+				continue;
+			ret = insert_cput_entry(shard, cputs[j]);
+			cputs[j] = NULL;
+			/* Already registered */
+			if (ret == -EBUSY)
+				ret = 0;
+			else if (ret == 0)
+				added++;
+			ents[j].status = ret;
+		}
+		unlock_shard(shard, locked);
+	}
+	return added;
+}
+
+/* 
+ * Registers a batch of processes and stores the result of each one
+ * in its status: 0 if it is registered, which includes a repeated
+ * registration, or a negative error code.
+ */
+static void register_pids(struct usrt_batch_ent *ents, unsigned int n)
+{
+	unsigned int i, added;
+
+	added = 0;
+	for (i = 0; i < n; i += REG_CHUNK)
+		added += register_chunk(ents + i, min(n - i, (unsigned int)REG_CHUNK));
+	if (added)
+		status_changed();
+}
+
+/* 
+ * Removes up to REG_CHUNK processes from the registry, locking each
+ * shard once. A process that is not registered gets -ENOENT.
+ */
+static void deregister_chunk(struct usrt_batch_ent *ents, unsigned int n)
+{
+	unsigned int nrs[REG_CHUNK];
+	struct cput_entry *cput;
+	struct cput_shard *shard;
+	unsigned int i, j;
+	u64 locked;
+
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		nrs[i] = ents[i].pid > 0 ? pid_nr(find_vpid(ents[i].pid)) : 0;
+		ents[i].status = nrs[i] ? -ENOENT : -ESRCH;
+	}
+	rcu_read_unlock();
+	for (i = 0; i < n; i++) {
+		if (nrs[i] == 0)
+			continue;
+		shard = pid_shard(nrs[i]);
+		locked = lock_shard(shard);
+		for (j = i; j < n; j++) {
+			if (nrs[j] == 0 || pid_shard(nrs[j]) != shard)
+				continue;
+			cput = xa_load(&shard->xa, nrs[j]);
+			/* An exited process is being removed by reap_exited() */
+			if (cput && !test_and_set_bit(CPUT_EXITED, &cput->flags)) {
+				if (cput->throttle)
+					release_entry(cput);
+				remove_cput_entry(shard, cput);
+				ents[j].status = 0;
+			}
+			nrs[j] = 0;
+		}
+		unlock_shard(shard, locked);
+	}
+}
+
+static void deregister_pids(struct usrt_batch_ent *ents, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i += REG_CHUNK)
+		deregister_chunk(ents + i, min(n - i, (unsigned int)REG_CHUNK));
+}
+
 /* 
- * Work function 
- * (Botton-Half of the Two-Halves interrupt handler design) 
+ * Adds the process with the given pid to the registry, sampled
+ * every period_ms msecs or every interval msecs if period_ms is 0,
+ * with a CPU budget of budget_ms msecs every window_ms msecs if
+ * budget_ms is not 0. A repeated registration of the same pid is
+ * ignored.
  */
-static void update_cputimes(struct work_struct *work)
+static int register_pid(int pid, unsigned int period_ms,
+						unsigned int budget_ms, unsigned int window_ms)
 {
-   struct cput_entry *entry, *temp;
+	struct usrt_batch_ent ent = {
+		.pid = pid,
+		.period_ms = period_ms,
+		.budget_ms = budget_ms,
+		.window_ms = window_ms,
+	};
 
-	mutex_lock(&cput_list_lock); 
-	list_for_each_entry_safe(entry, temp, &cput_list, list)
-		if (get_cpu_use(entry->pid, &entry->time)) {
-			list_del(&entry->list);
-			kfree(entry);
-		}
-	mutex_unlock(&cput_list_lock);
-	mod_timer(&ktimer, jiffies + msecs_to_jiffies(INTERVAL));
+	register_pids(&ent, 1);
+	return ent.status;
 }
 
-/* 
- * Timer interrupt handler 
- * (the Top-Half of the Two-Halves interrupt handler design) 
- */
-static void schedule_cput_upds(struct timer_list *timer)
+/* Removes the process with the given pid from the registry */
+static void deregister_pid(int pid)
 {
-	/* Skip scheduling work if there are no registered processes */
-	if (list_empty(&cput_list)) {
-		mod_timer(&ktimer, jiffies + msecs_to_jiffies(INTERVAL));
-		return;
-	}
-	/* Schedule update_cputimes(), the work function w/ the workqueue */
-	if (!queue_work(workqueue, &work)) {
-		printk(KERN_ALERT "error: queue_work failed\n");
-	}
+	struct usrt_batch_ent ent = { .pid = pid };
+
+	deregister_pids(&ent, 1);
 }
 
-static ssize_t usr_read(struct file *file,
-								char __user *buffer, 
-								size_t count, loff_t *off)
+/* 
+ * Registers or deregisters the array of struct usrt_batch_ent that
+ * struct usrt_batch points to, and copies it back with the status of
+ * every process filled in.
+ */
+static long usr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-	int copied;
-	char *kbuf;
-	struct cput_entry *entry;
+	struct usrt_batch batch;
+	struct usrt_batch_ent *ents;
+	void __user *uents;
+	size_t size;
+	long ret;
 
-	copied = 0;
-	kbuf = (char *)kmalloc(count, GFP_KERNEL);
-	if (kbuf == NULL) {
-		printk(KERN_ALERT "error: kmalloc: no memory available\n");
-		return copied;
-	}
-	mutex_lock(&cput_list_lock);
-	list_for_each_entry(entry, &cput_list, list)
-		copied += sprintf(kbuf + copied, "%u: %u\n", 
-			entry->pid, jiffies_to_msecs(clock_t_to_jiffies(entry->time)));
-	mutex_unlock(&cput_list_lock);
-	kbuf[copied] = '\0';
-	if (copy_to_user(buffer, kbuf, copied)) {
-		printk(KERN_ALERT "error: copy_to_user failed\n");
+	if (cmd != USRT_IOC_REGISTER && cmd != USRT_IOC_DEREGISTER)
+		return -ENOTTY;
+	if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nr == 0 || batch.nr > USRT_BATCH_MAX)
+		return -EINVAL;
+	size = batch.nr * sizeof(struct usrt_batch_ent);
+	uents = u64_to_user_ptr(batch.ents);
+	ents = kvmalloc(size, GFP_KERNEL);
+	if (ents == NULL) {
+		printk(KERN_ALERT "error: kvmalloc: no memory available\n");
+		return -ENOMEM;
 	}
-	kfree(kbuf);
-
-	#ifdef DEBUG
-	printk(KERN_INFO "USER READ\n");
-	#endif
-     
-	if (*off > 0) /* EOF condition */
-		return 0;  /* End of file */
-	*off += copied;
-	return copied;
+	ret = 0;
+	if (copy_from_user(ents, uents, size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	if (cmd == USRT_IOC_REGISTER)
+		register_pids(ents, batch.nr);
+	else
+		deregister_pids(ents, batch.nr);
+	if (copy_to_user(uents, ents, size))
+		ret = -EFAULT;
+out:
+	kvfree(ents);
+	return ret;
 }
 
+/* 
+ * Writing "<pid>" registers the process, "<pid> <period>" registers
+ * it with its own sampling period in msecs, "<pid> <period> <budget>
+ * <window>" also limits it to budget msecs of CPU time every window
+ * msecs, and writing the negated pid (e.g. "-1234") deregisters it.
+ * Writing "since <seq>" turns the reads of the open file into delta
+ * reads.
+ */
 static ssize_t usr_write(struct file *file,
 								 const char __user *buffer,
 								 size_t count, loff_t *off)
 {
+	struct seq_file *m = file->private_data;
+	struct usr_iter *it = m->private;
+	char kbuf[MAX_MSG_LEN];
+	unsigned int period_ms, budget_ms, window_ms;
+	u64 since;
 	int pid;
 	int ret;
-	struct cput_entry *cput;
 
-	if ((ret = kstrtoint_from_user(buffer, count, 10, &pid))) {
-		switch (-ret) {
-		case ERANGE:
-			printk(KERN_ALERT "error: kstrtoint: overflow\n");
-			break;
-		case EINVAL:
-			printk(KERN_ALERT "error: kstrtoint: parsing error\n");
-			break;
-		}
+	if (count >= MAX_MSG_LEN)
+		return -EINVAL;
+	if (copy_from_user(kbuf, buffer, count)) {
+		printk(KERN_ALERT "error: copy_from_user failed\n");
+		return -EFAULT;
+	}
+	kbuf[count] = '\0';
+	/* 
+	 * Delta reads follow the changes found by the sampling passes,
+	 * which the lazy mode does not run.
+	 */
+	if (sscanf(kbuf, "since %llu", &since) == 1) {
+		if (lazy)
+			return -EOPNOTSUPP;
+		it->since = since;
+		it->delta = true;
+		return count;
+	}
+	period_ms = budget_ms = window_ms = 0;
+	if (sscanf(kbuf, "%d %u %u %u", &pid, &period_ms, &budget_ms,
+			   &window_ms) < 1) {
+		printk(KERN_ALERT "error: write: parsing error\n");
 		return -EIO;
 	}
-	cput = kmalloc(sizeof(struct cput_entry), GFP_KERNEL);
-	if (cput == NULL) {
-		printk(KERN_ALERT "error: kmalloc: no memory available\n");
-		return -ENOMEM;
+	if (pid < 0) {
+		deregister_pid(-pid);
+	} else {
+		if ((ret = register_pid(pid, period_ms, budget_ms, window_ms)))
+			return ret;
 	}
-	cput->pid = pid;
-	cput->time = 0;
-	INIT_LIST_HEAD(&cput->list);
-	mutex_lock(&cput_list_lock);
-	list_add(&cput->list, &cput_list);
-	mutex_unlock(&cput_list_lock);
 
 	#ifdef DEBUG
 	printk(KERN_INFO "USER WRITED\n");
@@ -152,56 +1926,757 @@ static ssize_t usr_write(struct file *file,
 	return count;
 }
 
+/* 
+ * Handlers of the netlink commands. They run in the context of
+ * the sender, so the pids are resolved in its pid namespace just
+ * like the ones written to usrt/status.
+ */
+static int nl_regs(struct genl_info *info, struct usrt_nl_reg **regs)
+{
+	struct nlattr *attr = info->attrs[USRT_ATTR_REGS];
+
+	if (attr == NULL || nla_len(attr) % sizeof(struct usrt_nl_reg))
+		return -EINVAL;
+	*regs = nla_data(attr);
+	return nla_len(attr) / sizeof(struct usrt_nl_reg);
+}
+
+static int nl_batch(struct genl_info *info, bool reg)
+{
+	struct usrt_batch_ent *ents;
+	struct usrt_nl_reg *regs;
+	int i, n, err;
+
+	if ((n = nl_regs(info, &regs)) <= 0)
+		return n;
+	/* Netlink registrations carry no budget, which is left 0 */
+	ents = kvcalloc(n, sizeof(struct usrt_batch_ent), GFP_KERNEL);
+	if (ents == NULL)
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		ents[i].pid = regs[i].pid;
+		ents[i].period_ms = regs[i].period_ms;
+	}
+	if (reg)
+		register_pids(ents, n);
+	else
+		deregister_pids(ents, n);
+	err = 0;
+	/* Not being registered is what deregistering is after */
+	for (i = 0; i < n && !err; i++)
+		if (reg || ents[i].status != -ENOENT)
+			err = ents[i].status;
+	kvfree(ents);
+	return err;
+}
+
+static int nl_register(struct sk_buff *skb, struct genl_info *info)
+{
+	return nl_batch(info, true);
+}
+
+static int nl_deregister(struct sk_buff *skb, struct genl_info *info)
+{
+	return nl_batch(info, false);
+}
+
+static const struct nla_policy usrt_genl_policy[USRT_ATTR_MAX + 1] = {
+	[USRT_ATTR_REGS] = { .type = NLA_BINARY },
+};
+
+static const struct genl_ops usrt_genl_ops[] = {
+	{
+		.cmd = USRT_CMD_REGISTER,
+		.doit = nl_register,
+	},
+	{
+		.cmd = USRT_CMD_DEREGISTER,
+		.doit = nl_deregister,
+	},
+};
+
+static const struct genl_multicast_group usrt_genl_mcgrps[] = {
+	[USRT_MCGRP_SAMPLES_ID] = { .name = USRT_MCGRP_SAMPLES },
+};
+
+static struct genl_family usrt_genl = {
+	.name = USRT_GENL_NAME,
+	.version = USRT_GENL_VERSION,
+	.maxattr = USRT_ATTR_MAX,
+	.policy = usrt_genl_policy,
+	.ops = usrt_genl_ops,
+	.n_ops = ARRAY_SIZE(usrt_genl_ops),
+	.mcgrps = usrt_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(usrt_genl_mcgrps),
+	.module = THIS_MODULE,
+};
+
+static struct cput_group *alloc_group(void)
+{
+	struct cput_group *grp;
+
+	grp = kzalloc(sizeof(struct cput_group), GFP_KERNEL);
+	if (grp == NULL)
+		return NULL;
+	grp->runtime = alloc_percpu(u64);
+	if (grp->runtime == NULL) {
+		kfree(grp);
+		return NULL;
+	}
+	return grp;
+}
+
+/* Total CPU time of a group in nsecs */
+static u64 group_runtime(struct cput_group *grp)
+{
+	u64 sum = grp->base;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(*per_cpu_ptr(grp->runtime, cpu));
+	return sum;
+}
+
+/* 
+ * Adds a group to one of the group indexes. A repeated registration
+ * is ignored.
+ */
+static int insert_group(struct xarray *xa, atomic_t *nr,
+						struct cput_group *grp)
+{
+	int ret;
+
+	mutex_lock(&group_lock);
+	ret = xa_insert(xa, grp->id, grp, GFP_KERNEL);
+	if (!ret)
+		atomic_inc(nr);
+	mutex_unlock(&group_lock);
+	if (ret) {
+		free_group(grp);
+		/* Already registered */
+		if (ret == -EBUSY)
+			return 0;
+		printk(KERN_ALERT "error: xa_insert failed\n");
+	}
+	return ret;
+}
+
+/* 
+ * Registers the thread group of tgid. The runtime of the group up 
+ * to now is read once, by walking its threads, and only the runtime
+ * accounted after that is added by the probe.
+ */
+static int register_tg(int tgid)
+{
+	struct cput_group *grp;
+	struct task_struct *leader, *t;
+	struct pid *kpid;
+	u64 base;
+
+	kpid = find_get_pid(tgid);
+	if (kpid == NULL)
+		return -ESRCH;
+	base = 0;
+	rcu_read_lock();
+	leader = pid_task(kpid, PIDTYPE_TGID);
+	if (leader) {
+		base = READ_ONCE(leader->signal->sum_sched_runtime);
+		for_each_thread(leader, t)
+			base += READ_ONCE(t->se.sum_exec_runtime);
+	}
+	rcu_read_unlock();
+	if (leader == NULL) {
+		put_pid(kpid);
+		return -ESRCH;
+	}
+	grp = alloc_group();
+	if (grp == NULL) {
+		printk(KERN_ALERT "error: alloc_group: no memory available\n");
+		put_pid(kpid);
+		return -ENOMEM;
+	}
+	grp->id = pid_nr(kpid);
+	grp->kpid = kpid;
+	grp->base = base;
+	return insert_group(&tg_xa, &nr_tgs, grp);
+}
+
+static void deregister_tg(int tgid)
+{
+	struct cput_group *grp;
+	unsigned int nr;
+
+	rcu_read_lock();
+	nr = pid_nr(find_vpid(tgid));
+	rcu_read_unlock();
+	if (nr == 0)
+		return;
+	mutex_lock(&group_lock);
+	grp = xa_load(&tg_xa, nr);
+	/* An exited thread group is being removed by reap_exited() */
+	if (grp && !test_and_set_bit(CPUT_EXITED, &grp->flags)) {
+		xa_erase(&tg_xa, nr);
+		atomic_dec(&nr_tgs);
+	} else {
+		grp = NULL;
+	}
+	mutex_unlock(&group_lock);
+	if (grp)
+		free_group(grp);
+}
+
+#ifdef CONFIG_CGROUPS
+/* 
+ * Registers the cgroup at path, relative to the root of the cgroup
+ * v2 hierarchy. Its CPU time counts from the registration on.
+ */
+static int register_cgroup(const char *path)
+{
+	struct cput_group *grp;
+	struct cgroup *cgrp;
+
+	cgrp = cgroup_get_from_path(path);
+	if (IS_ERR(cgrp))
+		return PTR_ERR(cgrp);
+	grp = alloc_group();
+	if (grp)
+		grp->path = kstrdup(path, GFP_KERNEL);
+	if (grp == NULL || grp->path == NULL) {
+		printk(KERN_ALERT "error: alloc_group: no memory available\n");
+		cgroup_put(cgrp);
+		if (grp)
+			free_group(grp);
+		return -ENOMEM;
+	}
+	grp->id = cgroup_id(cgrp);
+	grp->cgrp = cgrp;
+	return insert_group(&cg_xa, &nr_cgs, grp);
+}
+
+static int deregister_cgroup(const char *path)
+{
+	struct cput_group *grp;
+	struct cgroup *cgrp;
+
+	cgrp = cgroup_get_from_path(path);
+	if (IS_ERR(cgrp))
+		return PTR_ERR(cgrp);
+	mutex_lock(&group_lock);
+	grp = xa_erase(&cg_xa, cgroup_id(cgrp));
+	if (grp)
+		atomic_dec(&nr_cgs);
+	mutex_unlock(&group_lock);
+	cgroup_put(cgrp);
+	if (grp)
+		free_group(grp);
+	return 0;
+}
+#else
+static int register_cgroup(const char *path)
+{
+	return -EOPNOTSUPP;
+}
+
+static int deregister_cgroup(const char *path)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+static int grp_show(struct seq_file *m, void *v)
+{
+	struct cput_group *grp;
+	unsigned long index;
+
+	rcu_read_lock();
+	xa_for_each(&tg_xa, index, grp)
+		seq_printf(m, "%llu: %llu\n", grp->id, group_runtime(grp));
+	xa_for_each(&cg_xa, index, grp)
+		seq_printf(m, "%s: %llu\n", grp->path, group_runtime(grp));
+	rcu_read_unlock();
+	return 0;
+}
+
+static int grp_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, grp_show, NULL);
+}
+
+/* 
+ * Writing "<tgid>" registers a thread group and "/<path>" a cgroup.
+ * Either one is deregistered by prefixing it with '-'.
+ */
+static ssize_t grp_write(struct file *file,
+						 const char __user *buffer,
+						 size_t count, loff_t *off)
+{
+	char *kbuf, *arg;
+	bool remove;
+	int tgid;
+	int ret;
+
+	if (count >= PATH_MAX)
+		return -EINVAL;
+	kbuf = memdup_user_nul(buffer, count);
+	if (IS_ERR(kbuf))
+		return PTR_ERR(kbuf);
+	arg = strim(kbuf);
+	remove = arg[0] == '-';
+	if (remove)
+		arg++;
+	if (arg[0] == '/') {
+		ret = remove ? deregister_cgroup(arg) : register_cgroup(arg);
+	} else if (kstrtoint(arg, 10, &tgid) || tgid <= 0) {
+		printk(KERN_ALERT "error: write: parsing error\n");
+		ret = -EIO;
+	} else if (remove) {
+		deregister_tg(tgid);
+		ret = 0;
+	} else {
+		ret = register_tg(tgid);
+	}
+	kfree(kbuf);
+	return ret ? ret : count;
+}
+
 /* Use proc_ops instead of file_operations on version >= 5.6 */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
 static const struct proc_ops usrt_file = {
-	.proc_read = usr_read,
+	.proc_open = usr_open,
+	.proc_poll = usr_poll,
+	.proc_ioctl = usr_ioctl,
+#ifdef CONFIG_COMPAT
+	.proc_compat_ioctl = compat_ptr_ioctl,
+#endif
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = seq_release_private,
 	.proc_write = usr_write,
 };
 #else
 static const struct file_operations usrt_file = {
 	.owner = THIS_MODULE,
-	.read = usr_read,
+	.open = usr_open,
+	.poll = usr_poll,
+	.unlocked_ioctl = usr_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
 	.write = usr_write,
 };
 #endif
 
+static int snap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	/* The snapshot is read-only for userspace */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range(vma, snap_buf, vma->vm_pgoff);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops snap_file = {
+	.proc_mmap = snap_mmap,
+};
+#else
+static const struct file_operations snap_file = {
+	.owner = THIS_MODULE,
+	.mmap = snap_mmap,
+};
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops grp_file = {
+	.proc_open = grp_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = grp_write,
+};
+#else
+static const struct file_operations grp_file = {
+	.owner = THIS_MODULE,
+	.open = grp_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = grp_write,
+};
+#endif
+
+/* 
+ * usrt/top lists the topk heaviest processes of the last passes as
+ * "pid: delta usage", where delta is the CPU time in nsecs over the 
+ * last sampling period of the process and usage is in percent.
+ * Processes deregistered since then are left out.
+ */
+static int top_show(struct seq_file *m, void *v)
+{
+	struct cput_top *row;
+	unsigned int i;
+
+	mutex_lock(&top_lock);
+	rcu_read_lock();
+	for (i = 0; i < nr_top; i++) {
+		row = &top_rows[i];
+		if (xa_load(&pid_shard(row->pid)->xa, row->pid) == NULL)
+			continue;
+		seq_printf(m, "%u: %llu %u.%02u\n", row->pid, row->delta,
+				   row->usage / 100, row->usage % 100);
+	}
+	rcu_read_unlock();
+	mutex_unlock(&top_lock);
+	return 0;
+}
+
+static int top_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, top_show, NULL);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+static const struct proc_ops top_file = {
+	.proc_open = top_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+#else
+static const struct file_operations top_file = {
+	.owner = THIS_MODULE,
+	.open = top_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+/* 
+ * usrt/stats in debugfs shows the counters and the histograms summed
+ * over all CPUs, and writing anything to it resets them.
+ */
+static int dbg_show(struct seq_file *m, void *v)
+{
+	u64 counters[NR_DBG_COUNTERS] = { 0 };
+	u64 hist[DBG_HIST_BUCKETS];
+	u64 count, sum;
+	struct cput_dbg *d;
+	unsigned int i, k;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		d = per_cpu_ptr(dbg, cpu);
+		for (i = 0; i < NR_DBG_COUNTERS; i++)
+			counters[i] += READ_ONCE(d->counters[i]);
+	}
+	for (i = 0; i < NR_DBG_COUNTERS; i++)
+		seq_printf(m, "%s: %llu\n", dbg_counter_names[i], counters[i]);
+	for (i = 0; i < NR_DBG_HISTS; i++) {
+		memset(hist, 0, sizeof(hist));
+		count = sum = 0;
+		for_each_possible_cpu(cpu) {
+			d = per_cpu_ptr(dbg, cpu);
+			count += READ_ONCE(d->count[i]);
+			sum += READ_ONCE(d->sum[i]);
+			for (k = 0; k < DBG_HIST_BUCKETS; k++)
+				hist[k] += READ_ONCE(d->hist[i][k]);
+		}
+		seq_printf(m, "%s_ns: count %llu avg %llu\n", dbg_hist_names[i],
+				   count, count ? div64_u64(sum, count) : 0);
+		for (k = 0; k < DBG_HIST_BUCKETS; k++)
+			if (hist[k])
+				seq_printf(m, "  %llu: %llu\n", k ? 1ULL << k : 0, hist[k]);
+	}
+	return 0;
+}
+
+static int dbg_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dbg_show, NULL);
+}
+
+static ssize_t dbg_write(struct file *file, const char __user *buffer,
+						 size_t count, loff_t *off)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dbg, cpu), 0, sizeof(struct cput_dbg));
+	return count;
+}
+
+static const struct file_operations dbg_file = {
+	.owner = THIS_MODULE,
+	.open = dbg_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = dbg_write,
+};
+
+/* 
+ * Stops the sampling and frees the registry, once nothing can 
+ * register processes or hook their exit anymore.
+ */
+static void free_registry(void)
+{
+	struct cput_entry *entry;
+	struct cput_group *grp;
+	unsigned long index;
+	unsigned int i, j;
+
+	/* 
+	 * Release the timers after the remaining handlers finish 
+	 * their execution.
+	 */
+	WRITE_ONCE(stopping, true);
+	for (i = 0; i < MAX_BUCKETS; i++)
+		hrtimer_cancel(&buckets[i].timer);
+	/* Wait until all pending works in the workqueue finish */
+	flush_workqueue(workqueue);
+	/* Free all of the registered entries */
+	for (i = 0; i < nr_shards; i++) {
+		xa_for_each(&shards[i].xa, index, entry) {
+			/* Nothing is to stay throttled after the module is gone */
+			if (entry->throttle)
+				release_entry(entry);
+			free_cput_entry(entry);
+		}
+		xa_destroy(&shards[i].xa);
+		xa_destroy(&shards[i].by_seq);
+		xa_destroy(&shards[i].gone);
+	}
+	for (i = 0; i < nr_shards; i++) {
+		for (j = 0; j < MAX_BUCKETS; j++)
+			kfree(shards[i].staged[j].samples);
+		kfree(shards[i].top[0].rows);
+	}
+	kfree(top_rows);
+	kfree(top_merge);
+	kfree(shards);
+	xa_for_each(&tg_xa, index, grp)
+		free_group(grp);
+	xa_destroy(&tg_xa);
+	xa_for_each(&cg_xa, index, grp)
+		free_group(grp);
+	xa_destroy(&cg_xa);
+	rcu_barrier();
+}
+
 int __init usrt_init(void)
 {
+	unsigned int i, j;
+	int ret = -ENOMEM;
+
 	#ifdef DEBUG
 	printk(KERN_INFO "USRT MODULE LOADING\n");
 	#endif
 
-	/* Create the proc filesystem entries: usrt/ and usrt/status */
+	/* Check the module parameters before anything is created */
+	if (snapshot_slots == 0 || snapshot_slots > SNAPSHOT_SLOTS_MAX) {
+		printk(KERN_ALERT "error: snapshot_slots is not between 1 and %u\n",
+			   SNAPSHOT_SLOTS_MAX);
+		return -EINVAL;
+	}
+	if (topk > TOPK_MAX) {
+		printk(KERN_ALERT "error: topk is larger than %u\n", TOPK_MAX);
+		return -EINVAL;
+	}
+	/* Create the proc filesystem directory: usrt/ */
 	proc_dir = proc_mkdir(DIRECTORY, NULL);
 	if (proc_dir == NULL) {
 		printk(KERN_ALERT "error: proc_mkdir failed\n");
 		return -ENOMEM;
 	}
-	proc_entry = proc_create(FILENAME, 0666, proc_dir, &usrt_file);
-	if (proc_entry == NULL) {
+	/* 
+	 * Allocate the snapshot shared with userspace and create 
+	 * usrt/snapshot through which it is mapped.
+	 */
+	snap_buf = vmalloc_user(SNAP_SIZE);
+	if (snap_buf == NULL) {
+		printk(KERN_ALERT "error: vmalloc_user: no memory available\n");
+		goto err_snap;
+	}
+	snap_hdr = snap_buf;
+	snap_recs = snap_buf + sizeof(struct usrt_snap_hdr);
+	snap_hdr->max_slots = snapshot_slots;
+	snap_entry = proc_create(SNAPSHOT, 0444, proc_dir, &snap_file);
+	if (snap_entry == NULL) {
 		printk(KERN_ALERT "error: proc_create failed\n");
-		return -ENOMEM;
+		goto err_snap_entry;
+	}
+	proc_set_size(snap_entry, SNAP_SIZE);
+	/* Set up the cache for slab allocator of cput_entry */
+	cput_entry_cache = kmem_cache_create("USRT Slab Alloc Cache",
+		sizeof(struct cput_entry), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (cput_entry_cache == NULL) {
+		printk(KERN_ALERT "error: kmem_cache_create failed\n");
+		goto err_entry_cache;
+	}
+	/* Set up the cache for slab allocator of the sample rings */
+	cput_ring_cache = kmem_cache_create("USRT Ring Cache",
+		sizeof(struct cput_ring), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (cput_ring_cache == NULL) {
+		printk(KERN_ALERT "error: kmem_cache_create failed\n");
+		goto err_ring_cache;
+	}
+	/* Set up the self-instrumentation and its debugfs entries */
+	dbg = alloc_percpu(struct cput_dbg);
+	if (dbg == NULL) {
+		printk(KERN_ALERT "error: alloc_percpu: no memory available\n");
+		goto err_dbg;
+	}
+	dbg_dir = debugfs_create_dir(DIRECTORY, NULL);
+	debugfs_create_file("stats", 0600, dbg_dir, NULL, &dbg_file);
+	/* 
+	 * Setup the high-resolution timers of the sampling buckets.
+	 * A timer is started by the first process of its bucket, and
+	 * never in the lazy mode.
+	 */
+	buckets[0].period_ms = interval;
+	for (i = 0; i < MAX_BUCKETS; i++) {
+		hrtimer_init(&buckets[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		buckets[i].timer.function = schedule_cput_upds;
 	}
-	/* Setup a kernel timer that wakes up every 5 secs */
-	timer_setup(&ktimer, schedule_cput_upds, 0);
-	mod_timer(&ktimer, jiffies + msecs_to_jiffies(INTERVAL));
 	/* 
-	 * Create a workqueue for work scheduling and initialize 
-	 * work to schedule with the work function defined above. 
+	 * Create an unbound, high priority workqueue so that the shards 
+	 * are sampled in parallel, and initialize the work of each shard
+	 * with the work function defined above.
 	 */
-	workqueue = create_workqueue("workqueue");
+	workqueue = alloc_workqueue("usrt", WQ_UNBOUND | WQ_HIGHPRI, 0);
 	if (workqueue == NULL) {
-		printk(KERN_ALERT "error: create_workqueue failed\n");
-		return -ENOMEM;
+		printk(KERN_ALERT "error: alloc_workqueue failed\n");
+		goto err_workqueue;
+	}
+	nr_shards = roundup_pow_of_two(max(num_possible_cpus(), 2U));
+	shard_bits = ilog2(nr_shards);
+	shards = kcalloc(nr_shards, sizeof(struct cput_shard), GFP_KERNEL);
+	if (shards == NULL) {
+		printk(KERN_ALERT "error: kcalloc: no memory available\n");
+		goto err_shards;
+	}
+	for (i = 0; i < nr_shards; i++) {
+		mutex_init(&shards[i].lock);
+		xa_init(&shards[i].xa);
+		xa_init(&shards[i].by_seq);
+		xa_init(&shards[i].gone);
+		for (j = 0; j < MAX_BUCKETS; j++) {
+			INIT_LIST_HEAD(&shards[i].lists[j]);
+			INIT_WORK(&shards[i].works[j].work, update_cputimes);
+			shards[i].works[j].shard = &shards[i];
+			shards[i].works[j].bucket = j;
+		}
+	}
+	/* Allocate the arrays of the top processes */
+	if (topk) {
+		top_rows = kcalloc(2 * topk, sizeof(struct cput_top), GFP_KERNEL);
+		top_merge = kcalloc(2 * topk, sizeof(struct cput_top), GFP_KERNEL);
+		if (top_rows == NULL || top_merge == NULL) {
+			printk(KERN_ALERT "error: kcalloc: no memory available\n");
+			goto err_registry;
+		}
+		for (i = 0; i < nr_shards; i++) {
+			shards[i].top[0].rows = kcalloc(MAX_BUCKETS * 2 * topk,
+				sizeof(struct cput_top), GFP_KERNEL);
+			if (shards[i].top[0].rows == NULL) {
+				printk(KERN_ALERT "error: kcalloc: no memory available\n");
+				goto err_registry;
+			}
+			for (j = 1; j < MAX_BUCKETS; j++)
+				shards[i].top[j].rows = shards[i].top[0].rows + j * 2 * topk;
+		}
+	}
+	INIT_WORK(&exit_work, reap_exited);
+	/* 
+	 * Hook process exit and runtime accounting. The tracepoints 
+	 * are not exported to modules, so look them up among the 
+	 * kernel's tracepoints.
+	 */
+	for_each_kernel_tracepoint(find_tps, NULL);
+	if (exit_tp == NULL ||
+		tracepoint_probe_register(exit_tp, probe_process_exit, NULL)) {
+		printk(KERN_ALERT "error: tracepoint_probe_register failed\n");
+		ret = -ENOENT;
+		goto err_registry;
+	}
+	if (runtime_tp == NULL ||
+		tracepoint_probe_register(runtime_tp, probe_stat_runtime, NULL)) {
+		printk(KERN_ALERT "error: tracepoint_probe_register failed\n");
+		ret = -ENOENT;
+		goto err_runtime_tp;
+	}
+	/* 
+	 * Create usrt/status and the netlink family last, as processes
+	 * can register as soon as they appear.
+	 */
+	if (genl_register_family(&usrt_genl)) {
+		printk(KERN_ALERT "error: genl_register_family failed\n");
+		goto err_genl;
+	}
+	proc_entry = proc_create(FILENAME, 0666, proc_dir, &usrt_file);
+	if (proc_entry == NULL) {
+		printk(KERN_ALERT "error: proc_create failed\n");
+		goto err_status;
+	}
+	grp_entry = proc_create(GROUPS, 0666, proc_dir, &grp_file);
+	if (grp_entry == NULL) {
+		printk(KERN_ALERT "error: proc_create failed\n");
+		goto err_groups;
+	}
+	top_entry = proc_create(TOP, 0444, proc_dir, &top_file);
+	if (top_entry == NULL) {
+		printk(KERN_ALERT "error: proc_create failed\n");
+		goto err_top;
 	}
-	INIT_WORK(&work, update_cputimes);
 
 	#ifdef DEBUG
 	printk(KERN_INFO "USRT MODULE LOADED\n");
 	#endif
 	
 	return 0;
+
+	/* 
+	 * Undo the steps above in reverse order. Processes may have
+	 * been registered by then, which free_registry() releases.
+	 */
+err_top:
+	remove_proc_entry(GROUPS, proc_dir);
+err_groups:
+	remove_proc_entry(FILENAME, proc_dir);
+err_status:
+	genl_unregister_family(&usrt_genl);
+err_genl:
+	tracepoint_probe_unregister(runtime_tp, probe_stat_runtime, NULL);
+err_runtime_tp:
+	tracepoint_probe_unregister(exit_tp, probe_process_exit, NULL);
+	tracepoint_synchronize_unregister();
+err_registry:
+	free_registry();
+err_shards:
+	destroy_workqueue(workqueue);
+err_workqueue:
+	debugfs_remove_recursive(dbg_dir);
+	free_percpu(dbg);
+err_dbg:
+	kmem_cache_destroy(cput_ring_cache);
+err_ring_cache:
+	kmem_cache_destroy(cput_entry_cache);
+err_entry_cache:
+	remove_proc_entry(SNAPSHOT, proc_dir);
+err_snap_entry:
+	ida_destroy(&snap_ida);
+	vfree(snap_buf);
+err_snap:
+	remove_proc_entry(DIRECTORY, NULL);
+	return ret;
 }
 
 void __exit usrt_exit(void)
@@ -211,19 +2686,29 @@ void __exit usrt_exit(void)
 	#endif
 
 	/* Remove the proc filesystem entries created in init */
+	remove_proc_entry(TOP, proc_dir);
+	remove_proc_entry(GROUPS, proc_dir);
+	remove_proc_entry(SNAPSHOT, proc_dir);
 	remove_proc_entry(FILENAME, proc_dir);
 	remove_proc_entry(DIRECTORY, NULL);
+	genl_unregister_family(&usrt_genl);
+	debugfs_remove_recursive(dbg_dir);
+	/* Stop the hooks and wait until running probes return */
+	tracepoint_probe_unregister(runtime_tp, probe_stat_runtime, NULL);
+	tracepoint_probe_unregister(exit_tp, probe_process_exit, NULL);
+	tracepoint_synchronize_unregister();
+	/* Free the registry and then the workqueue and the caches */
+	free_registry();
+	destroy_workqueue(workqueue);
+	kmem_cache_destroy(cput_ring_cache);
+	kmem_cache_destroy(cput_entry_cache);
 	/* 
-	 * Release the timer after the remaining handler finishes 
-	 * its execution.
+	 * Pages still mapped by userspace stay alive until they 
+	 * are unmapped.
 	 */
-	del_timer_sync(&ktimer);
-	/* 
-	 * Wait until all pending works in the workqueue finish 
-    * and destroy the workqueue.
-    */
-	flush_workqueue(workqueue);
-	destroy_workqueue(workqueue);
+	ida_destroy(&snap_ida);
+	vfree(snap_buf);
+	free_percpu(dbg);
 
 	#ifdef DEBUG
 	printk(KERN_INFO "USRT MODULE UNLOADED\n");
@@ -1,12 +1,169 @@
 #ifndef __USERTIME_H__
 #define __USERTIME_H__
 
+#ifdef __KERNEL__
 #include <linux/pid.h>
 #include <linux/kthread.h>
+#else
+#include <linux/types.h>
+#endif
+#include <linux/ioctl.h>
 
 #define FILENAME "status"
+#define SNAPSHOT "snapshot"
+#define GROUPS "groups"
+#define TOP "top"
 #define DIRECTORY "usrt"
 #define INTERVAL 5000
-#define find_task_by_pid(nr) \
-			pid_task(find_vpid(nr), PIDTYPE_PID)
-#endif
\ No newline at end of file
+#define MAX_BUCKETS 8
+#define MAX_MSG_LEN 64
+#define RING_SIZE 64
+#define SNAPSHOT_SLOTS 16384
+#define SNAPSHOT_SLOTS_MAX (1 << 22)
+#define TOPK 10
+#define TOPK_MAX 256
+
+/* 
+ * Per-process metrics kept by the module. Times are in nsecs:
+ * utime and stime as adjusted by task_cputime_adjusted(), runtime
+ * is the time spent on the CPU as accounted by the scheduler and
+ * wait the time spent waiting on a run queue.
+ */
+struct usrt_stats {
+	__u64 utime;
+	__u64 stime;
+	__u64 runtime;
+	__u64 wait;
+	__u64 nvcsw;
+	__u64 nivcsw;
+	__u64 min_flt;
+	__u64 maj_flt;
+};
+
+/* 
+ * Layout of /proc/usrt/snapshot, which userspace maps read-only
+ * with mmap(). The file starts with struct usrt_snap_hdr followed
+ * by max_slots records of struct usrt_snap_rec, as set by the
+ * snapshot_slots module parameter. A record with pid 0 is a free
+ * slot, and only the first nr_slots records can be in use. Processes
+ * registered while all the slots are taken have no record, and
+ * nr_dropped is how many of them are currently registered.
+ *
+ * Each record is published under its own sequence count: seq is
+ * odd while the record is being written. A reader copies a record
+ * only if seq is even and unchanged after the copy, e.g.
+ *
+ *	do {
+ *		s = READ_ONCE(rec->seq);
+ *		rmb();
+ *		copy = *rec;
+ *		rmb();
+ *	} while ((s & 1) || READ_ONCE(rec->seq) != s);
+ *
+ * gen is the latest completed sampling pass, and sample_seq of a
+ * record is the pass that sampled it last.
+ */
+struct usrt_snap_hdr {
+	__u32 nr_slots;
+	__u32 max_slots;
+	__u64 gen;
+	__u32 nr_dropped;
+	__u32 reserved0;
+	__u64 reserved[5];
+};
+
+struct usrt_snap_rec {
+	__u32 pid;
+	__u32 seq;
+	__u64 utime_ns;
+	__u64 stime_ns;
+	__u64 sample_seq;
+};
+
+/* 
+ * Batch registration through ioctl() on /proc/usrt/status. The
+ * argument is a struct usrt_batch pointing to nr entries of struct
+ * usrt_batch_ent; only pid is used by USRT_IOC_DEREGISTER. The
+ * module writes the result for each pid into its status: 0 on
+ * success (a repeated registration included), -ESRCH for a pid
+ * that does not exist, -ENOENT for deregistering a pid that is not
+ * registered, -EPERM for a budget on a process that the caller may
+ * not signal, -EOPNOTSUPP for a budget in the lazy mode, or another
+ * negative error code.
+ */
+#define USRT_BATCH_MAX 65536
+
+struct usrt_batch_ent {
+	__s32 pid;
+	__u32 period_ms;
+	__s32 status;
+	/* CPU budget in msecs per window of window_ms msecs, 0 for none */
+	__u32 budget_ms;
+	__u32 window_ms;
+	__u32 reserved;
+};
+
+struct usrt_batch {
+	__u32 nr;
+	__u32 reserved;
+	/* User pointer to the array of struct usrt_batch_ent */
+	__u64 ents;
+};
+
+#define USRT_IOC_MAGIC 'u'
+#define USRT_IOC_REGISTER _IOW(USRT_IOC_MAGIC, 1, struct usrt_batch)
+#define USRT_IOC_DEREGISTER _IOW(USRT_IOC_MAGIC, 2, struct usrt_batch)
+
+/* 
+ * Generic netlink family "usrt". USRT_CMD_REGISTER and
+ * USRT_CMD_DEREGISTER take a batch of processes as an array of
+ * struct usrt_nl_reg in USRT_ATTR_REGS (period_ms is ignored on
+ * deregistration); the first error in the batch, if any, is
+ * returned in the ack. After each sampling pass, the processes
+ * whose CPU time changed are multicast to the "samples" group as
+ * USRT_CMD_SAMPLES messages: USRT_ATTR_GEN is the pass, and
+ * USRT_ATTR_SAMPLES an array of struct usrt_nl_sample, at most
+ * USRT_NL_BATCH per message. USRT_ATTR_LAST marks the last message
+ * of a pass. A registered process that exits is multicast once more
+ * with its final CPU time and USRT_SAMPLE_EXITED set in flags, in
+ * messages of their own whose USRT_ATTR_GEN is the latest completed
+ * pass.
+ */
+#define USRT_GENL_NAME "usrt"
+#define USRT_GENL_VERSION 1
+#define USRT_MCGRP_SAMPLES "samples"
+#define USRT_NL_BATCH 512
+
+enum {
+	USRT_CMD_UNSPEC,
+	USRT_CMD_REGISTER,
+	USRT_CMD_DEREGISTER,
+	USRT_CMD_SAMPLES,
+	__USRT_CMD_MAX,
+};
+
+enum {
+	USRT_ATTR_UNSPEC,
+	USRT_ATTR_REGS,
+	USRT_ATTR_GEN,
+	USRT_ATTR_SAMPLES,
+	USRT_ATTR_LAST,
+	USRT_ATTR_PAD,
+	__USRT_ATTR_MAX,
+};
+#define USRT_ATTR_MAX (__USRT_ATTR_MAX - 1)
+
+struct usrt_nl_reg {
+	__s32 pid;
+	__u32 period_ms;
+};
+
+struct usrt_nl_sample {
+	__u32 pid;
+	__u32 flags;
+	struct usrt_stats stats;
+};
+
+#define USRT_SAMPLE_EXITED 0x1
+
+#endif